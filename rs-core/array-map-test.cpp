@@ -1,6 +1,9 @@
 #include "rs-core/array-map.hpp"
 #include "rs-core/string.hpp"
 #include "rs-core/unit-test.hpp"
+#include <cstdint>
+#include <utility>
+#include <vector>
 
 using namespace RS;
 
@@ -134,11 +137,194 @@ namespace {
 
     }
 
+    enum class Colour: uint16_t { red = 1, green, blue };
+
+    template <typename K>
+    void check_scan_type() {
+
+        for (size_t n = 0; n <= 40; ++n) {
+            ArraySet<K> set;
+            for (size_t i = 0; i < n; ++i)
+                TRY(set.insert(K(3 * i + 1)));
+            TEST_EQUAL(set.size(), n);
+            for (size_t i = 0; i < n; ++i) {
+                auto it = set.find(K(3 * i + 1));
+                REQUIRE(it != set.end());
+                TEST_EQUAL(it - set.begin(), ptrdiff_t(i));
+                TEST(! set.has(K(3 * i + 2)));
+            }
+            TEST(! set.has(K(0)));
+        }
+
+    }
+
+    void check_array_set_scan() {
+
+        check_scan_type<int8_t>();
+        check_scan_type<uint16_t>();
+        check_scan_type<int32_t>();
+        check_scan_type<uint64_t>();
+
+        ArraySet<int64_t> set;
+        TRY(set.insert(-1));
+        TRY(set.insert(0x100000000ll));
+        TRY(set.insert(0xffffffffll));
+        TEST(! set.has(0));
+        TEST(! set.has(1));
+        TEST(! set.has(0x1ffffffffll));
+        TEST_EQUAL(set.find(0xffffffffll) - set.begin(), 2);
+
+        ArraySet<Colour> colours = {Colour::red, Colour::green, Colour::blue};
+        TEST_EQUAL(colours.find(Colour::blue) - colours.begin(), 2);
+
+        int values[100];
+        ArraySet<const int*> pointers;
+        for (auto& v: values)
+            TRY(pointers.insert(&v));
+        TEST_EQUAL(pointers.find(values + 77) - pointers.begin(), 77);
+        TEST(! pointers.has(nullptr));
+
+    }
+
+    void check_sorted_array_map() {
+
+        ArrayMap<int, U8string, ArrayMapMode::sorted> map;
+        std::vector<std::pair<int, U8string>> vec;
+        U8string s;
+
+        TEST(map.empty());
+        TEST(! map.has(10));
+        TEST(map.find(10) == map.end());
+
+        TEST(map.insert({30, "hello"}).second);
+        TEST(map.insert({10, "world"}).second);
+        TEST(map.insert({20, "goodbye"}).second);
+        TEST(! map.insert({20, "again"}).second);
+        TEST_EQUAL(map.size(), 3);
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{10:world,20:goodbye,30:hello}");
+
+        TRY(map[25] = "foo");
+        TRY(map[10] = "bar");
+        TRY(map[5] = "zap");
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{5:zap,10:bar,20:goodbye,25:foo,30:hello}");
+        TEST_EQUAL(map.find(25)->second, "foo");
+        TEST(map.find(15) == map.end());
+        TEST(map.find(35) == map.end());
+
+        vec = {{40, "a"}, {1, "b"}, {20, "c"}, {7, "d"}, {7, "e"}, {50, "f"}};
+        TRY(map.insert_sorted(vec.begin(), vec.end()));
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{1:b,5:zap,7:d,10:bar,20:goodbye,25:foo,30:hello,40:a,50:f}");
+
+        TEST(map.erase(20));
+        TEST(! map.erase(20));
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{1:b,5:zap,7:d,10:bar,25:foo,30:hello,40:a,50:f}");
+
+        ArraySet<int, ArrayMapMode::sorted> set = {5, 3, 9, 3, 1};
+        TRY(s = to_str(set));
+        TEST_EQUAL(s, "[1,3,5,9]");
+
+        for (int n = 0; n <= 50; ++n) {
+            ArraySet<int, ArrayMapMode::sorted> set;
+            std::vector<int> keys;
+            for (int i = n - 1; i >= 0; --i)
+                keys.push_back(2 * i);
+            TRY(set.insert_sorted(keys.begin(), keys.end()));
+            TEST_EQUAL(int(set.size()), n);
+            for (int i = 0; i < n; ++i) {
+                TEST_EQUAL(set.find(2 * i) - set.begin(), i);
+                TEST(! set.has(2 * i + 1));
+            }
+            TEST(! set.has(-1));
+        }
+
+    }
+
+    void check_split_array_map() {
+
+        using map_type = ArrayMap<int, U8string, ArrayMapMode::unsorted, ArrayMapLayout::split>;
+        using sorted_type = ArrayMap<int, U8string, ArrayMapMode::sorted, ArrayMapLayout::split>;
+
+        map_type map;
+        map_type::iterator i;
+        map_type::const_iterator ci;
+        U8string s;
+
+        TEST(map.empty());
+        TEST(map.begin() == map.end());
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{}");
+
+        TEST(map.insert({30, "hello"}).second);
+        TEST(map.insert({20, "world"}).second);
+        TEST(map.insert({10, "goodbye"}).second);
+        TEST(! map.insert({20, "again"}).second);
+        TEST_EQUAL(map.size(), 3);
+        TEST_EQUAL(map.end() - map.begin(), 3);
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{30:hello,20:world,10:goodbye}");
+
+        TRY(map[30] = "foo");
+        TRY(map[40] = "bar");
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{30:foo,20:world,10:goodbye,40:bar}");
+
+        TRY(i = map.find(10));
+        REQUIRE(i != map.end());
+        TEST_EQUAL(i->first, 10);
+        TEST_EQUAL(i->second, "goodbye");
+        TEST_EQUAL((*i).second, "goodbye");
+        TRY(i->second = "hello again");
+        TEST_EQUAL(map[10], "hello again");
+        TEST_EQUAL(i[-1].first, 20);
+        TEST_EQUAL((i - 2)->first, 30);
+        TEST(map.begin() < i);
+        TRY(ci = i);
+        TEST(ci == map.find(10));
+
+        TRY(i = map.find(50));
+        TEST(i == map.end());
+
+        TRY(map.erase(map.begin()));
+        TEST(map.erase(10));
+        TEST(! map.erase(10));
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{20:world,40:bar}");
+
+        const map_type& cmap = map;
+        int sum = 0;
+        for (auto kv: cmap)
+            sum += kv.first + int(kv.second.size());
+        TEST_EQUAL(sum, 68);
+
+        sorted_type sorted = {{30, "a"}, {10, "b"}, {20, "c"}, {10, "d"}};
+        TRY(s = to_str(sorted));
+        TEST_EQUAL(s, "{10:b,20:c,30:a}");
+        TRY(sorted[15] = "e");
+        TEST(sorted.insert({5, "f"}).second);
+        TRY(s = to_str(sorted));
+        TEST_EQUAL(s, "{5:f,10:b,15:e,20:c,30:a}");
+        TEST_EQUAL(sorted.find(20)->second, "c");
+        TEST(! sorted.has(25));
+
+        std::vector<std::pair<int, U8string>> vec = {{25, "g"}, {1, "h"}, {30, "i"}};
+        TRY(sorted.insert_sorted(vec.begin(), vec.end()));
+        TRY(s = to_str(sorted));
+        TEST_EQUAL(s, "{1:h,5:f,10:b,15:e,20:c,25:g,30:a}");
+
+    }
+
 }
 
 TEST_MODULE(core, array_map) {
 
     check_array_map();
     check_array_set();
+    check_array_set_scan();
+    check_sorted_array_map();
+    check_split_array_map();
 
 }
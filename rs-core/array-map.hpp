@@ -4,11 +4,19 @@
 #include <algorithm>
 #include <initializer_list>
 #include <iterator>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
 namespace RS {
 
+    RS_ENUM_CLASS(ArrayMapLayout, int, 1, pairs, split);
+    RS_ENUM_CLASS(ArrayMapMode, int, 1, unsorted, sorted);
+
     namespace RS_Detail {
 
         template <typename K, typename T>
@@ -29,68 +37,324 @@ namespace RS {
             static bool match(const K& k, const K& v) noexcept { return k == v; }
         };
 
+        // Keys that can be compared by bit pattern, in a contiguous array,
+        // can be scanned several at a time
+
+        template <typename K>
+        struct ArrayMapScannable {
+            static constexpr bool value = (std::is_integral<K>::value || std::is_enum<K>::value || std::is_pointer<K>::value)
+                && ! std::is_same<K, bool>::value && (sizeof(K) == 1 || sizeof(K) == 2 || sizeof(K) == 4 || sizeof(K) == 8);
+        };
+
+        #ifdef __SSE2__
+
+            template <size_t N> inline __m128i array_map_splat(const void* p) noexcept;
+            template <> inline __m128i array_map_splat<1>(const void* p) noexcept { return _mm_set1_epi8(*static_cast<const char*>(p)); }
+            template <> inline __m128i array_map_splat<2>(const void* p) noexcept { int16_t x; memcpy(&x, p, 2); return _mm_set1_epi16(x); }
+            template <> inline __m128i array_map_splat<4>(const void* p) noexcept { int32_t x; memcpy(&x, p, 4); return _mm_set1_epi32(x); }
+            template <> inline __m128i array_map_splat<8>(const void* p) noexcept { int64_t x; memcpy(&x, p, 8); return _mm_set1_epi64x(x); }
+
+            template <size_t N> inline __m128i array_map_equal(__m128i a, __m128i b) noexcept;
+            template <> inline __m128i array_map_equal<1>(__m128i a, __m128i b) noexcept { return _mm_cmpeq_epi8(a, b); }
+            template <> inline __m128i array_map_equal<2>(__m128i a, __m128i b) noexcept { return _mm_cmpeq_epi16(a, b); }
+            template <> inline __m128i array_map_equal<4>(__m128i a, __m128i b) noexcept { return _mm_cmpeq_epi32(a, b); }
+            template <> inline __m128i array_map_equal<8>(__m128i a, __m128i b) noexcept {
+                // SSE2 has no 64-bit compare, so combine the two 32-bit halves
+                auto eq = _mm_cmpeq_epi32(a, b);
+                return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+            }
+
+        #endif
+
+        template <typename K>
+        size_t array_map_scan(const K* keys, size_t n, const K& k) noexcept {
+            size_t i = 0;
+            #ifdef __SSE2__
+                if constexpr (ArrayMapScannable<K>::value) {
+                    static constexpr size_t step = 16 / sizeof(K);
+                    auto target = array_map_splat<sizeof(K)>(&k);
+                    auto equal = [&] (size_t j) {
+                        auto block = _mm_loadu_si128(reinterpret_cast<const __m128i*>(keys + j));
+                        return array_map_equal<sizeof(K)>(block, target);
+                    };
+                    for (; i + 4 * step <= n; i += 4 * step) {
+                        // Test 64 bytes with one branch; shorter tails are
+                        // faster with a plain scalar loop
+                        auto eq0 = equal(i), eq1 = equal(i + step), eq2 = equal(i + 2 * step), eq3 = equal(i + 3 * step);
+                        if (_mm_movemask_epi8(_mm_or_si128(_mm_or_si128(eq0, eq1), _mm_or_si128(eq2, eq3)))) {
+                            uint64_t mask = uint64_t(uint16_t(_mm_movemask_epi8(eq0)))
+                                | (uint64_t(uint16_t(_mm_movemask_epi8(eq1))) << 16)
+                                | (uint64_t(uint16_t(_mm_movemask_epi8(eq2))) << 32)
+                                | (uint64_t(uint16_t(_mm_movemask_epi8(eq3))) << 48);
+                            return i + __builtin_ctzll(mask) / sizeof(K);
+                        }
+                    }
+                }
+            #endif
+            return std::find(keys + i, keys + n, k) - keys;
+        }
+
+        template <typename K, typename KeyAt>
+        size_t array_map_search(size_t n, KeyAt key_at, const K& k) noexcept {
+            // Branchless lower bound
+            if (n == 0)
+                return 0;
+            size_t base = 0;
+            while (n > 1) {
+                size_t half = n / 2;
+                base = key_at(base + half) < k ? base + half : base;
+                n -= half;
+            }
+            return base + size_t(key_at(base) < k);
+        }
+
+        template <typename K, typename T, bool Const>
+        class ArrayMapSplitIterator {
+        public:
+            using mapped_type = std::conditional_t<Const, const T, T>;
+            using difference_type = ptrdiff_t;
+            using iterator_category = std::random_access_iterator_tag;
+            using reference = std::pair<const K&, mapped_type&>;
+            using value_type = std::pair<K, T>;
+            struct pointer {
+                reference ref;
+                const reference* operator->() const noexcept { return &ref; }
+            };
+            ArrayMapSplitIterator() = default;
+            ArrayMapSplitIterator(const K* k, mapped_type* t) noexcept: kptr(k), tptr(t) {}
+            template <bool C = Const, typename = std::enable_if_t<C>>
+                ArrayMapSplitIterator(const ArrayMapSplitIterator<K, T, false>& i) noexcept: kptr(i.kptr), tptr(i.tptr) {}
+            reference operator*() const noexcept { return {*kptr, *tptr}; }
+            pointer operator->() const noexcept { return {**this}; }
+            reference operator[](ptrdiff_t i) const noexcept { return {kptr[i], tptr[i]}; }
+            ArrayMapSplitIterator& operator++() noexcept { ++kptr; ++tptr; return *this; }
+            ArrayMapSplitIterator operator++(int) noexcept { auto i = *this; ++*this; return i; }
+            ArrayMapSplitIterator& operator--() noexcept { --kptr; --tptr; return *this; }
+            ArrayMapSplitIterator operator--(int) noexcept { auto i = *this; --*this; return i; }
+            ArrayMapSplitIterator& operator+=(ptrdiff_t i) noexcept { kptr += i; tptr += i; return *this; }
+            ArrayMapSplitIterator& operator-=(ptrdiff_t i) noexcept { kptr -= i; tptr -= i; return *this; }
+            friend ArrayMapSplitIterator operator+(ArrayMapSplitIterator i, ptrdiff_t n) noexcept { return i += n; }
+            friend ArrayMapSplitIterator operator+(ptrdiff_t n, ArrayMapSplitIterator i) noexcept { return i += n; }
+            friend ArrayMapSplitIterator operator-(ArrayMapSplitIterator i, ptrdiff_t n) noexcept { return i -= n; }
+            friend ptrdiff_t operator-(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr - j.kptr; }
+            friend bool operator==(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr == j.kptr; }
+            friend bool operator!=(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr != j.kptr; }
+            friend bool operator<(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr < j.kptr; }
+            friend bool operator>(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr > j.kptr; }
+            friend bool operator<=(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr <= j.kptr; }
+            friend bool operator>=(const ArrayMapSplitIterator& i, const ArrayMapSplitIterator& j) noexcept { return i.kptr >= j.kptr; }
+        private:
+            friend class ArrayMapSplitIterator<K, T, true>;
+            const K* kptr = nullptr;
+            mapped_type* tptr = nullptr;
+        };
+
+        template <typename K, typename T, ArrayMapLayout L>
+        class ArrayMapStorage {
+        public:
+            using traits = ArrayMapTraits<K, T>;
+            using value_type = typename traits::value_type;
+            using array_type = std::vector<value_type>;
+            using const_iterator = typename array_type::const_iterator;
+            using iterator = typename array_type::iterator;
+            static constexpr bool contiguous_keys = std::is_void<T>::value;
+            iterator begin() noexcept { return array.begin(); }
+            const_iterator begin() const noexcept { return array.begin(); }
+            iterator end() noexcept { return array.end(); }
+            const_iterator end() const noexcept { return array.end(); }
+            size_t capacity() const noexcept { return array.capacity(); }
+            void clear() noexcept { array.clear(); }
+            void erase(size_t pos) noexcept { array.erase(array.begin() + pos); }
+            void insert(size_t pos, const value_type& v) { array.insert(array.begin() + pos, v); }
+            const K& key(size_t pos) const noexcept { return traits::key(array[pos]); }
+            const K* keys() const noexcept { return array.data(); } // set only
+            typename traits::mapped_ref mapped(size_t pos) noexcept { return array[pos].second; } // map only
+            void reserve(size_t n) { array.reserve(n); }
+            size_t size() const noexcept { return array.size(); }
+            template <typename F> void update(F f) { f(array); }
+        private:
+            array_type array;
+        };
+
+        template <typename K, typename T>
+        class ArrayMapStorage<K, T, ArrayMapLayout::split> {
+        public:
+            using traits = ArrayMapTraits<K, T>;
+            using value_type = typename traits::value_type;
+            using const_iterator = ArrayMapSplitIterator<K, T, true>;
+            using iterator = ArrayMapSplitIterator<K, T, false>;
+            static constexpr bool contiguous_keys = true;
+            iterator begin() noexcept { return {key_array.data(), value_array.data()}; }
+            const_iterator begin() const noexcept { return {key_array.data(), value_array.data()}; }
+            iterator end() noexcept { return begin() + size(); }
+            const_iterator end() const noexcept { return begin() + size(); }
+            size_t capacity() const noexcept { return key_array.capacity(); }
+            void clear() noexcept { key_array.clear(); value_array.clear(); }
+            void erase(size_t pos) noexcept { key_array.erase(key_array.begin() + pos); value_array.erase(value_array.begin() + pos); }
+            void insert(size_t pos, const value_type& v);
+            const K& key(size_t pos) const noexcept { return key_array[pos]; }
+            const K* keys() const noexcept { return key_array.data(); }
+            T& mapped(size_t pos) noexcept { return value_array[pos]; }
+            void reserve(size_t n) { key_array.reserve(n); value_array.reserve(n); }
+            size_t size() const noexcept { return key_array.size(); }
+            template <typename F> void update(F f);
+        private:
+            std::vector<K> key_array;
+            std::vector<T> value_array;
+        };
+
+        template <typename K>
+        class ArrayMapStorage<K, void, ArrayMapLayout::split>:
+        public ArrayMapStorage<K, void, ArrayMapLayout::pairs> {};
+
+        template <typename K, typename T>
+        void ArrayMapStorage<K, T, ArrayMapLayout::split>::insert(size_t pos, const value_type& v) {
+            key_array.insert(key_array.begin() + pos, v.first);
+            try {
+                value_array.insert(value_array.begin() + pos, v.second);
+            }
+            catch (...) {
+                key_array.erase(key_array.begin() + pos);
+                throw;
+            }
+        }
+
+        template <typename K, typename T>
+        template <typename F>
+        void ArrayMapStorage<K, T, ArrayMapLayout::split>::update(F f) {
+            // Operations that rearrange the whole map work on a temporary
+            // array of pairs; the map is unchanged if they fail
+            std::vector<value_type> array;
+            array.reserve(size());
+            for (size_t i = 0; i < size(); ++i)
+                array.emplace_back(key_array[i], value_array[i]);
+            f(array);
+            std::vector<K> new_keys;
+            std::vector<T> new_values;
+            new_keys.reserve(array.size());
+            new_values.reserve(array.size());
+            for (auto& v: array) {
+                new_keys.push_back(std::move(v.first));
+                new_values.push_back(std::move(v.second));
+            }
+            key_array.swap(new_keys);
+            value_array.swap(new_values);
+        }
+
     }
 
-    template <typename K, typename T>
+    template <typename K, typename T, ArrayMapMode M = ArrayMapMode::unsorted, ArrayMapLayout L = ArrayMapLayout::pairs>
     class ArrayMap {
     private:
+        using storage_type = RS_Detail::ArrayMapStorage<K, T, L>;
         using traits = RS_Detail::ArrayMapTraits<K, T>;
-        using array_type = std::vector<typename traits::value_type>;
-        array_type array;
+        storage_type store;
     public:
-        using const_iterator = typename array_type::const_iterator;
-        using iterator = typename array_type::iterator;
+        using const_iterator = typename storage_type::const_iterator;
+        using iterator = typename storage_type::iterator;
         using key_type = K;
         using mapped_type = T;
         using value_type = typename traits::value_type;
+        static constexpr ArrayMapLayout layout = L;
+        static constexpr ArrayMapMode mode = M;
         ArrayMap() = default;
-        ArrayMap(std::initializer_list<value_type> list): array(list) {}
+        ArrayMap(std::initializer_list<value_type> list);
         typename traits::mapped_ref operator[](const K& k); // map only
-        iterator begin() noexcept { return array.begin(); }
-        const_iterator begin() const noexcept { return array.begin(); }
-        iterator end() noexcept { return array.end(); }
-        const_iterator end() const noexcept { return array.end(); }
-        size_t capacity() const noexcept { return array.capacity(); }
-        void clear() noexcept { array.clear(); }
-        bool empty() const noexcept { return array.empty(); }
+        iterator begin() noexcept { return store.begin(); }
+        const_iterator begin() const noexcept { return store.begin(); }
+        iterator end() noexcept { return store.end(); }
+        const_iterator end() const noexcept { return store.end(); }
+        size_t capacity() const noexcept { return store.capacity(); }
+        void clear() noexcept { store.clear(); }
+        bool empty() const noexcept { return store.size() == 0; }
         bool erase(const K& k) noexcept;
-        void erase(const_iterator i) noexcept { array.erase(i); }
-        iterator find(const K& k) noexcept { return std::find_if(begin(), end(), [&] (const value_type& v) { return traits::match(k, v); }); }
-        const_iterator find(const K& k) const noexcept { return std::find_if(begin(), end(), [&] (const value_type& v) { return traits::match(k, v); }); }
-        bool has(const K& k) const noexcept { return find(k) != end(); }
+        void erase(const_iterator i) noexcept { store.erase(i - const_iterator(store.begin())); }
+        iterator find(const K& k) noexcept { return begin() + index_of(k); }
+        const_iterator find(const K& k) const noexcept { return begin() + index_of(k); }
+        bool has(const K& k) const noexcept { return index_of(k) != store.size(); }
         std::pair<iterator, bool> insert(const value_type& v);
-        void reserve(size_t n) { array.reserve(n); }
-        size_t size() const noexcept { return array.size(); }
+        template <typename InputIterator> void insert_sorted(InputIterator i, InputIterator j); // sorted only
+        void reserve(size_t n) { store.reserve(n); }
+        size_t size() const noexcept { return store.size(); }
+    private:
+        size_t index_of(const K& k) const noexcept;
+        size_t position_of(const K& k) const noexcept;
     };
 
-    template <typename K> using ArraySet = ArrayMap<K, void>;
+    template <typename K, ArrayMapMode M = ArrayMapMode::unsorted> using ArraySet = ArrayMap<K, void, M>;
 
-    template <typename K, typename T>
-    typename ArrayMap<K, T>::traits::mapped_ref ArrayMap<K, T>::operator[](const K& k) {
-        auto i = find(k);
-        if (i == end()) {
-            array.push_back({k, {}});
-            i = std::prev(end());
-        }
-        return i->second;
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    ArrayMap<K, T, M, L>::ArrayMap(std::initializer_list<value_type> list) {
+        if constexpr (M == ArrayMapMode::sorted)
+            insert_sorted(list.begin(), list.end());
+        else
+            store.update([&] (auto& array) { array = list; });
+    }
+
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    typename ArrayMap<K, T, M, L>::traits::mapped_ref ArrayMap<K, T, M, L>::operator[](const K& k) {
+        size_t pos = position_of(k);
+        if (pos == store.size() || ! (store.key(pos) == k))
+            store.insert(pos, {k, {}});
+        return store.mapped(pos);
     }
 
-    template <typename K, typename T>
-    bool ArrayMap<K, T>::erase(const K& k) noexcept {
-        auto i = find(k);
-        if (i == end())
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    bool ArrayMap<K, T, M, L>::erase(const K& k) noexcept {
+        size_t pos = index_of(k);
+        if (pos == store.size())
             return false;
-        array.erase(i);
+        store.erase(pos);
         return true;
     }
 
-    template <typename K, typename T>
-    std::pair<typename ArrayMap<K, T>::iterator, bool> ArrayMap<K, T>::insert(const value_type& v) {
-        auto i = find(traits::key(v));
-        if (i != end())
-            return {i, false};
-        array.push_back(v);
-        return {std::prev(end()), true};
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    std::pair<typename ArrayMap<K, T, M, L>::iterator, bool> ArrayMap<K, T, M, L>::insert(const value_type& v) {
+        const K& k = traits::key(v);
+        size_t pos = position_of(k);
+        if (pos < store.size() && store.key(pos) == k)
+            return {begin() + pos, false};
+        store.insert(pos, v);
+        return {begin() + pos, true};
+    }
+
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    template <typename InputIterator>
+    void ArrayMap<K, T, M, L>::insert_sorted(InputIterator i, InputIterator j) {
+        static_assert(M == ArrayMapMode::sorted, "insert_sorted() requires a sorted ArrayMap");
+        auto less = [] (const value_type& a, const value_type& b) { return traits::key(a) < traits::key(b); };
+        auto equal = [] (const value_type& a, const value_type& b) { return ! (traits::key(a) < traits::key(b)) && ! (traits::key(b) < traits::key(a)); };
+        store.update([&] (auto& array) {
+            size_t old_size = array.size();
+            array.insert(array.end(), i, j);
+            auto mid = array.begin() + old_size;
+            if (! std::is_sorted(mid, array.end(), less))
+                std::stable_sort(mid, array.end(), less);
+            std::inplace_merge(array.begin(), mid, array.end(), less);
+            array.erase(std::unique(array.begin(), array.end(), equal), array.end());
+        });
+    }
+
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    size_t ArrayMap<K, T, M, L>::index_of(const K& k) const noexcept {
+        size_t n = store.size();
+        if constexpr (M == ArrayMapMode::sorted) {
+            size_t pos = position_of(k);
+            return pos < n && store.key(pos) == k ? pos : n;
+        } else if constexpr (storage_type::contiguous_keys) {
+            return RS_Detail::array_map_scan(store.keys(), n, k);
+        } else {
+            return std::find_if(store.begin(), store.end(), [&] (const value_type& v) { return traits::match(k, v); }) - store.begin();
+        }
+    }
+
+    template <typename K, typename T, ArrayMapMode M, ArrayMapLayout L>
+    size_t ArrayMap<K, T, M, L>::position_of(const K& k) const noexcept {
+        // Position of the key if present, otherwise where it should be inserted
+        if constexpr (M == ArrayMapMode::sorted)
+            return RS_Detail::array_map_search(store.size(), [this] (size_t i) -> const K& { return store.key(i); }, k);
+        else
+            return index_of(k);
     }
 
 }
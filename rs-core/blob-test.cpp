@@ -1,5 +1,9 @@
 #include "rs-core/blob.hpp"
+#include "rs-core/file.hpp"
 #include "rs-core/unit-test.hpp"
+#include <stdexcept>
+#include <string>
+#include <system_error>
 
 using namespace RS;
 
@@ -64,10 +68,211 @@ namespace {
 
     }
 
+    void check_blob_storage() {
+
+        Blob a, b, c;
+        const void* p = nullptr;
+        auto inside = [] (const Blob& x) {
+            auto addr = reinterpret_cast<const char*>(x.data());
+            auto obj = reinterpret_cast<const char*>(&x);
+            return addr >= obj && addr < obj + sizeof(Blob);
+        };
+
+        TRY(a = Blob(Blob::small_size, 'a'));
+        TEST(inside(a));
+        TRY(b = Blob(Blob::small_size + 1, 'b'));
+        TEST(! inside(b));
+        TRY(c = a);
+        TEST(inside(c));
+        TEST_EQUAL(c.str(), U8string(Blob::small_size, 'a'));
+
+        TRY(p = b.data());
+        TRY(c = std::move(b));
+        TEST(b.empty());
+        TEST_EQUAL(c.data(), p);
+        TEST_EQUAL(c.str(), U8string(Blob::small_size + 1, 'b'));
+
+        TRY(swap(a, c));
+        TEST(inside(c));
+        TEST(! inside(a));
+        TEST_EQUAL(a.data(), p);
+        TEST_EQUAL(a.str(), U8string(Blob::small_size + 1, 'b'));
+        TEST_EQUAL(c.str(), U8string(Blob::small_size, 'a'));
+
+        TRY(b = std::move(c));
+        TEST(c.empty());
+        TEST(inside(b));
+        TEST_EQUAL(b.str(), U8string(Blob::small_size, 'a'));
+
+        U8string s, h = "hello";
+
+        TRY(a = Blob(&h[0], 5, [&] (void*) { s += "a"; }));
+        TRY(b = std::move(a));
+        TRY(c.copy("world", 5));
+        TRY(swap(b, c));
+        TRY(swap(b, b));
+        TEST_EQUAL(s, "");
+        TEST_EQUAL(b.str(), "world");
+        TEST_EQUAL(c.str(), "hello");
+        TEST_EQUAL(c.data(), &h[0]);
+        TRY(c.clear());
+        TEST_EQUAL(s, "a");
+
+        TRY(a = Blob(&h[0], 5, [] (void* ptr) { static_cast<char*>(ptr)[0] = 'j'; }));
+        TRY(b = std::move(a));
+        TRY(b.clear());
+        TEST_EQUAL(h, "jello");
+
+    }
+
+    void check_blob_alignment() {
+
+        Blob b;
+
+        for (size_t align: {1, 2, 16, 64, 4096}) {
+            for (size_t n: {1, 10, 100, 10000}) {
+                TRY(b = Blob::aligned(n, align));
+                TEST_EQUAL(b.size(), n);
+                TEST_EQUAL(reinterpret_cast<uintptr_t>(b.data()) % align, 0);
+                TRY(b.fill('x'));
+                TEST_EQUAL(b.bdata()[n - 1], 'x');
+            }
+        }
+
+        for (size_t n: {1, 3000000}) {
+            TRY(b = Blob::aligned(n, 64, Blob::huge_pages));
+            TEST_EQUAL(b.size(), n);
+            TEST_EQUAL(reinterpret_cast<uintptr_t>(b.data()) % 64, 0);
+            TRY(b.fill('y'));
+            TEST_EQUAL(b.bdata()[n - 1], 'y');
+        }
+
+        TRY(b = Blob::aligned(0, 64));
+        TEST(b.empty());
+        TEST_THROW(Blob::aligned(100, 0), std::invalid_argument);
+        TEST_THROW(Blob::aligned(100, 48), std::invalid_argument);
+
+    }
+
+    void check_shared_blob() {
+
+        SharedBlob a, b, c;
+        Blob x;
+        const void* p = nullptr;
+
+        TEST(a.empty());
+        TEST_EQUAL(a.size(), 0);
+        TEST_EQUAL(a.str(), "");
+        TEST_EQUAL(a.use_count(), 0);
+
+        TRY(a = SharedBlob("Hello world", 11));
+        TEST_EQUAL(a.size(), 11);
+        TEST_EQUAL(a.str(), "Hello world");
+        TEST_EQUAL(a.hex(), "48 65 6c 6c 6f 20 77 6f 72 6c 64");
+        TRY(x.copy("Hello world", 11));
+        TEST_EQUAL(a.hash(), x.hash());
+        TEST_EQUAL(a.use_count(), 1);
+
+        TRY(b = a.slice(6));
+        TEST_EQUAL(b.str(), "world");
+        TEST_EQUAL(b.bdata(), a.bdata() + 6);
+        TEST_EQUAL(a.use_count(), 2);
+        TRY(c = a.slice(2, 3));
+        TEST_EQUAL(c.str(), "llo");
+        TEST_EQUAL(c.bdata(), a.bdata() + 2);
+        TRY(c = c.slice(1, 100));
+        TEST_EQUAL(c.str(), "lo");
+        TRY(c = a.slice(11));
+        TEST(c.empty());
+        TRY(c = a.slice(100, 5));
+        TEST(c.empty());
+        TEST_EQUAL(a.use_count(), 2);
+
+        TRY(a.clear());
+        TEST(a.empty());
+        TEST_EQUAL(b.str(), "world");
+        TEST_EQUAL(b.use_count(), 1);
+
+        TRY(c = b);
+        TEST_EQUAL(c.bdata(), b.bdata());
+        TEST(c == b);
+        TRY(c = SharedBlob("world", 5));
+        TEST(c == b);
+        TEST(c.bdata() != b.bdata());
+        TEST_EQUAL(c.hash(), b.hash());
+        TRY(c = SharedBlob("worlds", 6));
+        TEST(b < c);
+        TRY(c = b.slice(0, 4));
+        TEST(c < b);
+
+        TRY(x.reset(100, 'x'));
+        TRY(p = x.data());
+        TRY(a = SharedBlob(std::move(x)));
+        TEST(x.empty());
+        TEST_EQUAL(a.data(), p);
+        TEST_EQUAL(a.size(), 100);
+
+        U8string s, h = "hello";
+
+        TRY(a = SharedBlob(Blob(&h[0], 5, [&] (void*) { s += "a"; })));
+        TRY(b = a.slice(1, 3));
+        TEST_EQUAL(b.str(), "ell");
+        TRY(a.clear());
+        TEST_EQUAL(s, "");
+        TRY(b.clear());
+        TEST_EQUAL(s, "a");
+
+    }
+
+    void check_blob_mapping() {
+
+        const File f = "__test_blob_map";
+        const File g = "__test_blob_empty";
+        const File h = "__test_blob_missing";
+        const std::string text = "Hello world\n";
+        Blob b;
+
+        TRY(f.save(text));
+        TRY(g.save(""));
+
+        TRY(b = Blob::map(f));
+        TEST_EQUAL(b.size(), text.size());
+        TEST_EQUAL(b.str(), text);
+        TRY(b = Blob::map(f, Blob::map_sequential));
+        TEST_EQUAL(b.str(), text);
+        TRY(b = Blob::map(f, Blob::map_random));
+        TEST_EQUAL(b.str(), text);
+
+        TRY(b = Blob::map(f, Blob::map_private));
+        TEST_EQUAL(b.str(), text);
+        TRY(b.bdata()[0] = 'J');
+        TEST_EQUAL(b.str(), "Jello world\n");
+        TRY(b.clear());
+        TEST_EQUAL(f.load(), text);
+
+        SharedBlob sb;
+        TRY(sb = SharedBlob(Blob::map(f)));
+        TRY(sb = sb.slice(6, 5));
+        TEST_EQUAL(sb.str(), "world");
+        TRY(sb.clear());
+
+        TRY(b = Blob::map(g));
+        TEST(b.empty());
+        TEST_THROW(Blob::map(h), std::system_error);
+
+        TRY(f.remove());
+        TRY(g.remove());
+
+    }
+
 }
 
 TEST_MODULE(core, blob) {
 
     check_blob();
+    check_blob_storage();
+    check_blob_alignment();
+    check_shared_blob();
+    check_blob_mapping();
 
 }
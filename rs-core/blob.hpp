@@ -1,29 +1,47 @@
 #pragma once
 
 #include "rs-core/common.hpp"
+#include "rs-core/file.hpp"
 #include "rs-core/string.hpp"
 #include <algorithm>
+#include <cerrno>
 #include <cstdlib>
 #include <functional>
+#include <limits>
+#include <memory>
 #include <new>
+#include <stdexcept>
 #include <string>
+#include <system_error>
+#include <type_traits>
 #include <utility>
 
+#ifdef _XOPEN_SOURCE
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 namespace RS {
 
     class Blob:
     public LessThanComparable<Blob> {
     public:
-        Blob() = default;
+        static constexpr uint32_t map_private = 1;
+        static constexpr uint32_t map_random = 2;
+        static constexpr uint32_t map_sequential = 4;
+        static constexpr uint32_t huge_pages = 8;
+        Blob() noexcept {}
         explicit Blob(size_t n) { init_size(n); }
         Blob(size_t n, uint8_t x) { init_size(n); memset(ptr, x, len); }
         Blob(void* p, size_t n): Blob(p, n, &std::free) {}
-        template <typename F> Blob(void* p, size_t n, F f) { if (p && n) {ptr = p; len = n; del = f; } }
-        ~Blob() noexcept { if (ptr && del) try { del(ptr); } catch (...) {} }
+        template <typename F> Blob(void* p, size_t n, F f) { if (p && n) init_deleter(p, n, f); }
+        ~Blob() noexcept { release(); }
         Blob(const Blob& b) { init_copy(b.data(), b.size()); }
-        Blob(Blob&& b) noexcept: ptr(b.ptr), len(b.len) { del.swap(b.del); }
+        Blob(Blob&& b) noexcept { take(b); }
         Blob& operator=(const Blob& b) { copy(b.data(), b.size()); return *this; }
-        Blob& operator=(Blob&& b) noexcept { Blob b2(std::move(b)); swap(b2); return *this; }
+        Blob& operator=(Blob&& b) noexcept { if (&b != this) { release(); take(b); } return *this; }
         void* data() noexcept { return ptr; }
         const void* data() const noexcept { return ptr; }
         uint8_t* bdata() noexcept { return static_cast<uint8_t*>(ptr); }
@@ -34,23 +52,53 @@ namespace RS {
         Irange<const uint8_t*> bytes() const noexcept { return {bdata(), bdata() + len}; }
         Irange<char*> chars() noexcept { return {cdata(), cdata() + len}; }
         Irange<const char*> chars() const noexcept { return {cdata(), cdata() + len}; }
-        void clear() noexcept { Blob b; swap(b); }
-        void copy(const void* p, size_t n) { Blob b; b.init_copy(p, n); swap(b); }
+        void clear() noexcept { release(); }
+        void copy(const void* p, size_t n) { Blob b; b.init_copy(p, n); *this = std::move(b); }
         bool empty() const noexcept { return len == 0; }
         void fill(uint8_t x) noexcept { memset(ptr, x, len); }
-        size_t hash() const noexcept { return djb2a(ptr, len); }
+        size_t hash() const noexcept { return wyhash(ptr, len); }
         U8string hex(size_t block = 0) const { return hexdump(ptr, len, block); }
-        void reset(size_t n) { Blob b(n); swap(b); }
-        void reset(size_t n, uint8_t x) { Blob b(n, x); swap(b); }
-        void reset(void* p, size_t n) { Blob b(p, n); swap(b); }
-        template <typename F> void reset(void* p, size_t n, F f) { Blob b(p, n, f); swap(b); }
+        void reset(size_t n) { Blob b(n); *this = std::move(b); }
+        void reset(size_t n, uint8_t x) { Blob b(n, x); *this = std::move(b); }
+        void reset(void* p, size_t n) { Blob b(p, n); *this = std::move(b); }
+        template <typename F> void reset(void* p, size_t n, F f) { Blob b(p, n, f); *this = std::move(b); }
         size_t size() const noexcept { return len; }
         std::string str() const { return empty() ? std::string() : std::string(cdata(), len); }
-        void swap(Blob& b) noexcept { std::swap(ptr, b.ptr); std::swap(len, b.len); del.swap(b.del); }
+        void swap(Blob& b) noexcept { Blob t; t.take(b); b.take(*this); take(t); }
+        static Blob aligned(size_t n, size_t align, uint32_t flags = 0);
+        static Blob map(const File& f, uint32_t flags = 0);
+        static constexpr size_t small_size = 32;
     private:
+        using deleter_function = void (*)(void*);
+        using deleter_object = std::function<void(void*)>;
+        static_assert(sizeof(deleter_object) <= small_size, "Blob small buffer is too small");
+        // ptr == buf: data is stored inline
+        // fdel == nullptr: data is inline or not owned
+        // fdel == &custom_tag: owned, released by xdel
+        // any other fdel: owned, released by fdel
         void* ptr = nullptr;
         size_t len = 0;
-        std::function<void(void*)> del;
+        deleter_function fdel = nullptr;
+        union {
+            alignas(std::max_align_t) unsigned char buf[small_size];
+            deleter_object xdel;
+        };
+        static void custom_tag(void*) noexcept {}
+        bool is_custom() const noexcept { return fdel == &custom_tag; }
+        bool is_small() const noexcept { return ptr == buf; }
+        template <typename F> void init_deleter(void* p, size_t n, F f) {
+            if constexpr (std::is_convertible<F, deleter_function>::value) {
+                fdel = f;
+            } else {
+                deleter_object d(f);
+                if (d) {
+                    new (&xdel) deleter_object(std::move(d));
+                    fdel = &custom_tag;
+                }
+            }
+            ptr = p;
+            len = n;
+        }
         void init_copy(const void* p, size_t n) {
             if (p && n) {
                 init_size(n);
@@ -58,16 +106,174 @@ namespace RS {
             }
         }
         void init_size(size_t n) {
-            if (n) {
+            if (n <= small_size) {
+                if (n)
+                    ptr = buf;
+            } else {
                 ptr = std::malloc(n);
                 if (! ptr)
                     throw std::bad_alloc();
-                len = n;
-                del = &std::free;
+                fdel = &std::free;
             }
+            len = n;
+        }
+        void release() noexcept {
+            if (is_custom()) {
+                try { xdel(ptr); } catch (...) {}
+                xdel.~deleter_object();
+            } else if (fdel) {
+                try { fdel(ptr); } catch (...) {}
+            }
+            ptr = nullptr;
+            len = 0;
+            fdel = nullptr;
+        }
+        void take(Blob& b) noexcept {
+            // Assumes *this is empty
+            if (b.is_small()) {
+                memcpy(buf, b.buf, small_size);
+                ptr = buf;
+            } else {
+                ptr = b.ptr;
+                if (b.is_custom()) {
+                    new (&xdel) deleter_object(std::move(b.xdel));
+                    b.xdel.~deleter_object();
+                }
+            }
+            len = b.len;
+            fdel = b.fdel;
+            b.ptr = nullptr;
+            b.len = 0;
+            b.fdel = nullptr;
         }
     };
 
+    #ifdef _XOPEN_SOURCE
+
+        inline Blob Blob::aligned(size_t n, size_t align, uint32_t flags) {
+            static constexpr size_t huge_size = 2 << 20;
+            if (align == 0 || (align & (align - 1)))
+                throw std::invalid_argument("Invalid blob alignment: " + std::to_string(align));
+            if (n == 0)
+                return {};
+            if (flags & huge_pages) {
+                size_t page = ::sysconf(_SC_PAGESIZE);
+                size_t boundary = std::max({align, page, huge_size});
+                size_t len = (n + huge_size - 1) / huge_size * huge_size;
+                void* p = MAP_FAILED;
+                #ifdef MAP_HUGETLB
+                    if (boundary == huge_size)
+                        p = ::mmap(nullptr, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+                #endif
+                if (p == MAP_FAILED) {
+                    // Over-allocate and trim to an aligned boundary, so the
+                    // whole range is eligible for transparent huge pages
+                    errno = 0;
+                    void* q = ::mmap(nullptr, len + boundary, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+                    int err = errno;
+                    if (q == MAP_FAILED)
+                        throw std::system_error(err, std::generic_category());
+                    auto addr = reinterpret_cast<uintptr_t>(q);
+                    size_t head = (boundary - addr % boundary) % boundary;
+                    size_t tail = boundary - head;
+                    p = static_cast<char*>(q) + head;
+                    if (head)
+                        ::munmap(q, head);
+                    if (tail)
+                        ::munmap(static_cast<char*>(p) + len, tail);
+                    #ifdef MADV_HUGEPAGE
+                        ::madvise(p, len, MADV_HUGEPAGE);
+                    #endif
+                }
+                return Blob(p, n, [len] (void* ptr) { ::munmap(ptr, len); });
+            }
+            void* p = nullptr;
+            int rc = ::posix_memalign(&p, std::max(align, sizeof(void*)), n);
+            if (rc == ENOMEM)
+                throw std::bad_alloc();
+            else if (rc)
+                throw std::system_error(rc, std::generic_category());
+            return Blob(p, n);
+        }
+
+        inline Blob Blob::map(const File& f, uint32_t flags) {
+            errno = 0;
+            int fd = ::open(f.c_name(), O_RDONLY);
+            int err = errno;
+            if (fd == -1)
+                throw std::system_error(err, std::generic_category(), f.name());
+            ScopeExit guard([=] { ::close(fd); });
+            struct stat st;
+            errno = 0;
+            int rc = ::fstat(fd, &st);
+            err = errno;
+            if (rc)
+                throw std::system_error(err, std::generic_category(), f.name());
+            if (uint64_t(st.st_size) > uint64_t(std::numeric_limits<size_t>::max()))
+                throw std::length_error("File is too large to map: " + f.name());
+            size_t n = st.st_size;
+            if (n == 0)
+                return {};
+            int prot = flags & map_private ? PROT_READ | PROT_WRITE : PROT_READ;
+            int share = flags & map_private ? MAP_PRIVATE : MAP_SHARED;
+            errno = 0;
+            void* p = ::mmap(nullptr, n, prot, share, fd, 0);
+            err = errno;
+            if (p == MAP_FAILED)
+                throw std::system_error(err, std::generic_category(), f.name());
+            if (flags & map_random)
+                ::posix_madvise(p, n, POSIX_MADV_RANDOM);
+            else if (flags & map_sequential)
+                ::posix_madvise(p, n, POSIX_MADV_SEQUENTIAL);
+            return Blob(p, n, [n] (void* ptr) { ::munmap(ptr, n); });
+        }
+
+    #else
+
+        inline Blob Blob::aligned(size_t n, size_t align, uint32_t /*flags*/) {
+            if (align == 0 || (align & (align - 1)))
+                throw std::invalid_argument("Invalid blob alignment: " + std::to_string(align));
+            if (n == 0)
+                return {};
+            void* p = _aligned_malloc(n, align);
+            if (! p)
+                throw std::bad_alloc();
+            return Blob(p, n, &_aligned_free);
+        }
+
+        inline Blob Blob::map(const File& f, uint32_t flags) {
+            DWORD hint = 0;
+            if (flags & map_random)
+                hint = FILE_FLAG_RANDOM_ACCESS;
+            else if (flags & map_sequential)
+                hint = FILE_FLAG_SEQUENTIAL_SCAN;
+            auto wpath = f.native();
+            HANDLE fh = CreateFileW(wpath.data(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, hint, nullptr);
+            if (fh == INVALID_HANDLE_VALUE)
+                throw std::system_error(GetLastError(), windows_category(), f.name());
+            ScopeExit fguard([=] { CloseHandle(fh); });
+            LARGE_INTEGER li;
+            if (! GetFileSizeEx(fh, &li))
+                throw std::system_error(GetLastError(), windows_category(), f.name());
+            if (uint64_t(li.QuadPart) > uint64_t(std::numeric_limits<size_t>::max()))
+                throw std::length_error("File is too large to map: " + f.name());
+            size_t n = li.QuadPart;
+            if (n == 0)
+                return {};
+            DWORD protect = flags & map_private ? PAGE_WRITECOPY : PAGE_READONLY;
+            HANDLE mh = CreateFileMappingW(fh, nullptr, protect, 0, 0, nullptr);
+            if (! mh)
+                throw std::system_error(GetLastError(), windows_category(), f.name());
+            ScopeExit mguard([=] { CloseHandle(mh); });
+            DWORD access = flags & map_private ? FILE_MAP_COPY : FILE_MAP_READ;
+            void* p = MapViewOfFile(mh, access, 0, 0, 0);
+            if (! p)
+                throw std::system_error(GetLastError(), windows_category(), f.name());
+            return Blob(p, n, [] (void* ptr) { UnmapViewOfFile(ptr); });
+        }
+
+    #endif
+
     inline bool operator==(const Blob& lhs, const Blob& rhs) noexcept {
         return lhs.size() == rhs.size() && memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
     }
@@ -79,6 +285,62 @@ namespace RS {
 
     inline void swap(Blob& b1, Blob& b2) noexcept { b1.swap(b2); }
 
+    class SharedBlob:
+    public LessThanComparable<SharedBlob> {
+    public:
+        SharedBlob() = default;
+        explicit SharedBlob(Blob&& b) { if (! b.empty()) init_blob(std::make_shared<const Blob>(std::move(b))); }
+        explicit SharedBlob(const Blob& b): SharedBlob(Blob(b)) {}
+        SharedBlob(const void* p, size_t n) { Blob b; b.copy(p, n); *this = SharedBlob(std::move(b)); }
+        const void* data() const noexcept { return ptr; }
+        const uint8_t* bdata() const noexcept { return ptr; }
+        const char* cdata() const noexcept { return reinterpret_cast<const char*>(ptr); }
+        Irange<const uint8_t*> bytes() const noexcept { return {bdata(), bdata() + len}; }
+        Irange<const char*> chars() const noexcept { return {cdata(), cdata() + len}; }
+        void clear() noexcept { SharedBlob b; swap(b); }
+        bool empty() const noexcept { return len == 0; }
+        size_t hash() const noexcept { return wyhash(ptr, len); }
+        U8string hex(size_t block = 0) const { return hexdump(ptr, len, block); }
+        SharedBlob slice(size_t pos, size_t n = npos) const;
+        size_t size() const noexcept { return len; }
+        std::string str() const { return empty() ? std::string() : std::string(cdata(), len); }
+        void swap(SharedBlob& b) noexcept { owner.swap(b.owner); std::swap(ptr, b.ptr); std::swap(len, b.len); }
+        long use_count() const noexcept { return owner.use_count(); }
+    private:
+        std::shared_ptr<const Blob> owner;
+        const uint8_t* ptr = nullptr;
+        size_t len = 0;
+        void init_blob(std::shared_ptr<const Blob> b) noexcept {
+            owner = std::move(b);
+            ptr = owner->bdata();
+            len = owner->size();
+        }
+    };
+
+    inline SharedBlob SharedBlob::slice(size_t pos, size_t n) const {
+        pos = std::min(pos, len);
+        n = std::min(n, len - pos);
+        SharedBlob b;
+        if (n) {
+            b.owner = owner;
+            b.ptr = ptr + pos;
+            b.len = n;
+        }
+        return b;
+    }
+
+    inline bool operator==(const SharedBlob& lhs, const SharedBlob& rhs) noexcept {
+        return lhs.size() == rhs.size() && memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+    }
+
+    inline bool operator<(const SharedBlob& lhs, const SharedBlob& rhs) noexcept {
+        auto cmp = memcmp(lhs.data(), rhs.data(), std::min(lhs.size(), rhs.size()));
+        return cmp < 0 || (cmp == 0 && lhs.size() < rhs.size());
+    }
+
+    inline void swap(SharedBlob& b1, SharedBlob& b2) noexcept { b1.swap(b2); }
+
 }
 
 RS_DEFINE_STD_HASH(RS::Blob);
+RS_DEFINE_STD_HASH(RS::SharedBlob);
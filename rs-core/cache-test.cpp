@@ -1,11 +1,20 @@
 #include "rs-core/cache.hpp"
+#include "rs-core/thread.hpp"
 #include "rs-core/unit-test.hpp"
+#include <atomic>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+#include <thread>
+#include <vector>
 
 using namespace RS;
+using namespace std::chrono;
 
 namespace {
 
     int count = 0;
+    std::atomic<int> atomic_count(0);
 
     U8string f1(char c) { ++count; return {c}; }
     U8string f2(size_t n, char c) { ++count; return U8string(n, c); }
@@ -57,10 +66,351 @@ namespace {
 
     }
 
+    void check_cache_copy_and_move() {
+
+        Cache<U8string(char)> c1, c2, c3;
+        U8string s;
+
+        TRY(c1 = memoize(f1, 3));
+        count = 0;
+
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 1);
+        TRY(s = c1('b'));  TEST_EQUAL(s, "b");  TEST_EQUAL(count, 2);
+        TRY(s = c1('c'));  TEST_EQUAL(s, "c");  TEST_EQUAL(count, 3);
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 3);
+
+        TRY(c2 = c1);
+        TRY(s = c2('d'));  TEST_EQUAL(s, "d");  TEST_EQUAL(count, 4);
+        TRY(s = c2('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 4);
+        TRY(s = c2('c'));  TEST_EQUAL(s, "c");  TEST_EQUAL(count, 4);
+        TRY(s = c2('b'));  TEST_EQUAL(s, "b");  TEST_EQUAL(count, 5);
+        TRY(s = c1('b'));  TEST_EQUAL(s, "b");  TEST_EQUAL(count, 5);
+
+        TRY(c3 = std::move(c1));
+        TRY(s = c3('c'));  TEST_EQUAL(s, "c");  TEST_EQUAL(count, 5);
+        TRY(s = c3('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 5);
+        TRY(s = c3('d'));  TEST_EQUAL(s, "d");  TEST_EQUAL(count, 6);
+        TRY(s = c3('b'));  TEST_EQUAL(s, "b");  TEST_EQUAL(count, 7);
+
+        TRY(c1 = memoize(f1, 0));
+        count = 0;
+
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 1);
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 2);
+
+    }
+
+    void check_concurrent_cache() {
+
+        ConcurrentCache<U8string(char)> c1;
+        U8string s;
+
+        TRY(c1 = concurrent_memoize(f1, 3, 1));
+        TEST_EQUAL(c1.shards(), 1u);
+        count = 0;
+
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 1);
+        TRY(s = c1('b'));  TEST_EQUAL(s, "b");  TEST_EQUAL(count, 2);
+        TRY(s = c1('c'));  TEST_EQUAL(s, "c");  TEST_EQUAL(count, 3);
+        TRY(s = c1('b'));  TEST_EQUAL(s, "b");  TEST_EQUAL(count, 3);
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 3);
+        TRY(s = c1('d'));  TEST_EQUAL(s, "d");  TEST_EQUAL(count, 4);
+        TRY(s = c1('e'));  TEST_EQUAL(s, "e");  TEST_EQUAL(count, 5);
+        TRY(s = c1('c'));  TEST_EQUAL(s, "c");  TEST_EQUAL(count, 6);
+
+        TRY(c1.clear());
+        count = 0;
+
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 1);
+        TRY(s = c1('a'));  TEST_EQUAL(s, "a");  TEST_EQUAL(count, 1);
+
+        TRY(c1 = concurrent_memoize(f1));
+        TEST_EQUAL(c1.shards(), ConcurrentCache<U8string(char)>::default_shards());
+        TRY(c1 = concurrent_memoize(f1, 2, 10));
+        TEST_EQUAL(c1.shards(), 2u);
+
+    }
+
+    void check_concurrent_cache_threads() {
+
+        static constexpr int keys = 1000;
+        static constexpr int threads = 8;
+        static constexpr int calls = 20000;
+
+        auto f = [] (int x) { ++atomic_count; return x * x; };
+        ConcurrentCache<int(int)> c;
+        std::vector<Thread> workers;
+        std::atomic<int> errors(0);
+
+        TRY(c = concurrent_memoize(f, 2 * keys));
+
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back([&c,&errors,t] {
+                for (int i = 0; i < calls; ++i) {
+                    int x = (i * 7919 + t * 104729) % keys;
+                    if (c(x) != x * x)
+                        ++errors;
+                }
+            });
+        for (auto& w: workers)
+            TRY(w.wait());
+
+        TEST_EQUAL(errors, 0);
+        TEST_COMPARE(atomic_count, >=, keys);
+        TEST_COMPARE(atomic_count, <=, threads * keys);
+
+    }
+
+    void check_single_flight() {
+
+        static constexpr int threads = 8;
+
+        auto f = [] (int x) {
+            ++atomic_count;
+            std::this_thread::sleep_for(milliseconds(100));
+            if (x < 0)
+                throw std::invalid_argument("Negative");
+            return x * x;
+        };
+
+        ConcurrentCache<int(int)> c;
+        std::vector<Thread> workers;
+        std::atomic<int> errors(0), results(0);
+
+        TRY(c = concurrent_memoize(f, 100, 0, true));
+        TEST(c.single_flight());
+        atomic_count = 0;
+
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back([&] { if (c(42) == 1764) ++results; });
+        for (auto& w: workers)
+            TRY(w.wait());
+        workers.clear();
+
+        TEST_EQUAL(atomic_count, 1);
+        TEST_EQUAL(results, threads);
+        TEST_EQUAL(c(42), 1764);
+        TEST_EQUAL(atomic_count, 1);
+
+        for (int t = 0; t < threads; ++t)
+            workers.emplace_back([&] {
+                try { c(-1); }
+                catch (const std::invalid_argument&) { ++errors; }
+            });
+        for (auto& w: workers)
+            TRY(w.wait());
+        workers.clear();
+
+        TEST_EQUAL(atomic_count, 2);
+        TEST_EQUAL(errors, threads);
+        TEST_THROW_MATCH(c(-1), std::invalid_argument, "Negative");
+        TEST_EQUAL(atomic_count, 3);
+
+    }
+
+    void check_async_cache() {
+
+        auto f = [] (int x) {
+            ++atomic_count;
+            if (x < 0)
+                throw std::invalid_argument("Negative");
+            return x * x;
+        };
+
+        AsyncCache<int(int)> c;
+        AsyncCache<int(int)>::future_type fut;
+
+        TRY(c = async_memoize(f, 100));
+        atomic_count = 0;
+
+        TRY(fut = c(5));
+        REQUIRE(fut.valid());
+        TEST_EQUAL(fut.get(), 25);
+        TEST_EQUAL(atomic_count, 1);
+        TRY(fut = c(5));
+        TEST_EQUAL(fut.get(), 25);
+        TEST_EQUAL(atomic_count, 1);
+
+        TRY(fut = c(-5));
+        REQUIRE(fut.valid());
+        TEST_THROW_MATCH(fut.get(), std::invalid_argument, "Negative");
+        TEST_EQUAL(atomic_count, 2);
+        TRY(fut = c(-5));
+        TEST_THROW_MATCH(fut.get(), std::invalid_argument, "Negative");
+        TEST_EQUAL(atomic_count, 3);
+
+    }
+
+    void check_cache_cost_and_expiry() {
+
+        Cache<U8string(size_t, char)> c;
+        CacheStats st;
+        U8string s;
+
+        TRY(c = memoize(f2, 10));
+        TRY(c.set_cost([] (const U8string& str) { return str.size(); }));
+        count = 0;
+
+        TRY(s = c(3, 'a'));  TEST_EQUAL(s, "aaa");    TEST_EQUAL(count, 1);  TEST_EQUAL(c.size(), 1u);
+        TRY(s = c(4, 'b'));  TEST_EQUAL(s, "bbbb");   TEST_EQUAL(count, 2);  TEST_EQUAL(c.size(), 2u);
+        TRY(s = c(3, 'a'));  TEST_EQUAL(s, "aaa");    TEST_EQUAL(count, 2);  TEST_EQUAL(c.size(), 2u);
+        TRY(s = c(5, 'c'));  TEST_EQUAL(s, "ccccc");  TEST_EQUAL(count, 3);  TEST_EQUAL(c.size(), 2u);
+        TRY(s = c(3, 'a'));  TEST_EQUAL(s, "aaa");    TEST_EQUAL(count, 3);  TEST_EQUAL(c.size(), 2u);
+        TRY(s = c(4, 'b'));  TEST_EQUAL(s, "bbbb");   TEST_EQUAL(count, 4);  TEST_EQUAL(c.size(), 2u);
+        TRY(s = c(20, 'd'));                          TEST_EQUAL(count, 5);  TEST_EQUAL(c.size(), 2u);
+        TRY(s = c(20, 'd'));                          TEST_EQUAL(count, 6);  TEST_EQUAL(c.size(), 2u);
+
+        TRY(st = c.stats());
+        TEST_EQUAL(st.entries, 2u);
+        TEST_EQUAL(st.cost, 7u);
+        TEST_EQUAL(st.hits, 2u);
+        TEST_EQUAL(st.misses, 6u);
+        TEST_EQUAL(st.evictions, 2u);
+        TEST_EQUAL(st.expiries, 0u);
+
+        TRY(c = memoize(f2));
+        TRY(c.set_ttl(milliseconds(100)));
+        count = 0;
+
+        TRY(s = c(1, 'a'));  TEST_EQUAL(count, 1);
+        TRY(s = c(2, 'a'));  TEST_EQUAL(count, 2);
+        TRY(s = c(1, 'a'));  TEST_EQUAL(count, 2);
+        std::this_thread::sleep_for(milliseconds(150));
+        TRY(s = c(1, 'a'));  TEST_EQUAL(count, 3);
+        TRY(s = c(3, 'a'));  TEST_EQUAL(count, 4);
+        TEST_EQUAL(c.size(), 2u);
+
+        TRY(st = c.stats());
+        TEST_EQUAL(st.entries, 2u);
+        TEST_EQUAL(st.hits, 1u);
+        TEST_EQUAL(st.misses, 4u);
+        TEST_EQUAL(st.evictions, 0u);
+        TEST_EQUAL(st.expiries, 2u);
+
+        ConcurrentCache<U8string(size_t, char)> cc;
+
+        TRY(cc = concurrent_memoize(f2, 100, 4));
+        TRY(cc.set_cost([] (const U8string& str) { return str.size(); }));
+        count = 0;
+
+        for (size_t i = 1; i <= 10; ++i)
+            TRY(cc(i, 'x'));
+        for (size_t i = 1; i <= 10; ++i)
+            TRY(cc(i, 'x'));
+
+        TRY(st = cc.stats());
+        TEST_EQUAL(st.hits + st.misses, 20u);
+        TEST_EQUAL(size_t(count), st.misses);
+        TEST_EQUAL(st.entries, cc.size());
+        TEST_COMPARE(st.cost, <=, 100u);
+
+    }
+
+    template <typename Policy>
+    void check_policy_basics() {
+
+        Cache<int(int), Policy> c;
+        int n = 0;
+
+        TRY(c = memoize<Policy>([&n] (int x) { ++n; return x * x; }, 10));
+
+        for (int i = 0; i < 100; ++i) {
+            int x = (i * 37) % 25, y = 0;
+            TRY(y = c(x));
+            TEST_EQUAL(y, x * x);
+            TEST_COMPARE(c.size(), <=, 10u);
+        }
+
+        auto st = c.stats();
+        TEST_EQUAL(st.hits + st.misses, 100u);
+        TEST_EQUAL(size_t(n), st.misses);
+        TEST_EQUAL(st.entries, 10u);
+        TEST_EQUAL(st.misses - st.evictions, 10u);
+
+        TRY(c.clear());
+        TEST_EQUAL(c.size(), 0u);
+        TRY(c(1));
+        TRY(c(1));
+        TEST_EQUAL(c.size(), 1u);
+
+        Cache<int(int), Policy> d;
+        TRY(d = c);
+        TEST_EQUAL(d.size(), 1u);
+        n = 0;
+        TRY(d(1));
+        TEST_EQUAL(n, 0);
+
+    }
+
+    // Synthetic trace: Zipf distributed requests over a set of popular
+    // keys, interrupted by regular scans of keys that are never repeated
+
+    std::vector<int> zipf_scan_trace() {
+        static constexpr int popular = 1000;
+        static constexpr int requests = 50000;
+        static constexpr int scan_every = 2000;
+        static constexpr int scan_length = 500;
+        std::vector<double> weights;
+        for (int k = 1; k <= popular; ++k)
+            weights.push_back(1.0 / k);
+        std::mt19937 rng(42);
+        std::discrete_distribution<int> zipf(weights.begin(), weights.end());
+        std::vector<int> trace;
+        int scan_key = popular;
+        for (int i = 1; i <= requests; ++i) {
+            trace.push_back(zipf(rng));
+            if (i % scan_every == 0)
+                for (int j = 0; j < scan_length; ++j)
+                    trace.push_back(scan_key++);
+        }
+        return trace;
+    }
+
+    template <typename Policy>
+    double replay_hit_ratio(const std::vector<int>& trace, size_t cap) {
+        auto c = memoize<Policy>([] (int x) { return x; }, cap);
+        for (int x: trace)
+            c(x);
+        auto st = c.stats();
+        return double(st.hits) / double(st.hits + st.misses);
+    }
+
+    void check_cache_policies() {
+
+        check_policy_basics<LruPolicy>();
+        check_policy_basics<TwoQueuePolicy>();
+        check_policy_basics<TinyLfuPolicy>();
+
+        auto trace = zipf_scan_trace();
+        double lru = 0, two_queue = 0, tiny_lfu = 0;
+
+        TRY(lru = replay_hit_ratio<LruPolicy>(trace, 100));
+        TRY(two_queue = replay_hit_ratio<TwoQueuePolicy>(trace, 100));
+        TRY(tiny_lfu = replay_hit_ratio<TinyLfuPolicy>(trace, 100));
+
+        TEST_COMPARE(lru, >, 0.1);
+        TEST_COMPARE(two_queue, >, lru);
+        TEST_COMPARE(tiny_lfu, >, lru);
+
+        ConcurrentCache<int(int), TinyLfuPolicy> cc;
+        TRY(cc = concurrent_memoize<TinyLfuPolicy>([] (int x) { return x; }, 400, 4));
+        for (int x: trace)
+            TRY(cc(x));
+        TEST_COMPARE(cc.size(), <=, 400u);
+
+    }
+
 }
 
 TEST_MODULE(core, cache) {
 
     check_cache();
+    check_cache_copy_and_move();
+    check_cache_cost_and_expiry();
+    check_cache_policies();
+    check_concurrent_cache();
+    check_concurrent_cache_threads();
+    check_single_flight();
+    check_async_cache();
 
 }
@@ -1,62 +1,857 @@
 #pragma once
 
 #include "rs-core/common.hpp"
+#include "rs-core/thread.hpp"
+#include "rs-core/time.hpp"
+#include <chrono>
 #include <deque>
 #include <functional>
-#include <iterator>
+#include <future>
+#include <memory>
 #include <tuple>
 #include <unordered_map>
+#include <utility>
 
 namespace RS {
 
-    template <typename> class Cache;
+    // Cache statistics
 
-    template <typename Result, typename... Args>
-    class Cache<Result(Args...)> {
+    struct CacheStats {
+        size_t entries = 0;
+        size_t cost = 0;
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t evictions = 0;
+        size_t expiries = 0;
+        CacheStats& operator+=(const CacheStats& rhs) noexcept;
+    };
+
+        inline CacheStats& CacheStats::operator+=(const CacheStats& rhs) noexcept {
+            entries += rhs.entries;
+            cost += rhs.cost;
+            hits += rhs.hits;
+            misses += rhs.misses;
+            evictions += rhs.evictions;
+            expiries += rhs.expiries;
+            return *this;
+        }
+
+    // Cache eviction policies
+
+    namespace RS_Detail {
+
+        // Intrusive queue of cache entries, ordered from the next candidate
+        // for eviction at the front to the most recently queued at the back.
+        // Copying a queue yields an empty queue, since the links belong to
+        // the original table; CacheTable relinks the copied entries itself.
+
+        struct CacheLink {
+            CacheLink* prev = nullptr;
+            CacheLink* next = nullptr;
+            size_t cost = 1;
+            size_t hash = 0;
+            int queue = 0;
+        };
+
+        class CacheQueue {
+        public:
+            CacheQueue() = default;
+            CacheQueue(const CacheQueue&) noexcept {}
+            CacheQueue(CacheQueue&& q) noexcept: head(q.head), tail(q.tail), count(q.count), total(q.total) { q.clear(); }
+            ~CacheQueue() noexcept = default;
+            CacheQueue& operator=(const CacheQueue& q) noexcept { if (&q != this) clear(); return *this; }
+            CacheQueue& operator=(CacheQueue&& q) noexcept;
+            CacheLink* front() const noexcept { return head; }
+            void clear() noexcept { head = tail = nullptr; count = total = 0; }
+            size_t cost() const noexcept { return total; }
+            bool empty() const noexcept { return ! head; }
+            void move_to_back(CacheLink* x) noexcept { if (x != tail) { remove(x); push_back(x); } }
+            void push_back(CacheLink* x) noexcept;
+            void remove(CacheLink* x) noexcept;
+            size_t size() const noexcept { return count; }
+        private:
+            CacheLink* head = nullptr;
+            CacheLink* tail = nullptr;
+            size_t count = 0;
+            size_t total = 0;
+        };
+
+            inline CacheQueue& CacheQueue::operator=(CacheQueue&& q) noexcept {
+                if (&q != this) {
+                    head = q.head;
+                    tail = q.tail;
+                    count = q.count;
+                    total = q.total;
+                    q.clear();
+                }
+                return *this;
+            }
+
+            inline void CacheQueue::push_back(CacheLink* x) noexcept {
+                x->prev = tail;
+                x->next = nullptr;
+                if (tail)
+                    tail->next = x;
+                else
+                    head = x;
+                tail = x;
+                ++count;
+                total += x->cost;
+            }
+
+            inline void CacheQueue::remove(CacheLink* x) noexcept {
+                if (x->prev)
+                    x->prev->next = x->next;
+                else
+                    head = x->next;
+                if (x->next)
+                    x->next->prev = x->prev;
+                else
+                    tail = x->prev;
+                x->prev = x->next = nullptr;
+                --count;
+                total -= x->cost;
+            }
+
+        // Count-min sketch of 4-bit counters, halved after every 10 x width
+        // increments so that old popularity fades. The width is kept at a
+        // power of two no smaller than the number of entries being tracked.
+
+        class FrequencySketch {
+        public:
+            void clear() noexcept { counters.clear(); width = samples = 0; }
+            unsigned estimate(size_t hash) const noexcept;
+            void increment(size_t hash) noexcept;
+            void reserve(size_t n);
+        private:
+            static constexpr size_t depth = 4;
+            static constexpr uint8_t max_count = 15;
+            std::vector<uint8_t> counters;
+            size_t width = 0;
+            size_t samples = 0;
+            size_t index(size_t hash, size_t row) const noexcept;
+        };
+
+            inline unsigned FrequencySketch::estimate(size_t hash) const noexcept {
+                if (width == 0)
+                    return 0;
+                unsigned n = max_count;
+                for (size_t row = 0; row < depth; ++row)
+                    n = std::min(n, unsigned(counters[index(hash, row)]));
+                return n;
+            }
+
+            inline void FrequencySketch::increment(size_t hash) noexcept {
+                if (width == 0)
+                    return;
+                for (size_t row = 0; row < depth; ++row) {
+                    auto& c = counters[index(hash, row)];
+                    if (c < max_count)
+                        ++c;
+                }
+                if (++samples >= 10 * width) {
+                    for (auto& c: counters)
+                        c >>= 1;
+                    samples /= 2;
+                }
+            }
+
+            inline void FrequencySketch::reserve(size_t n) {
+                if (n <= width)
+                    return;
+                size_t w = 64;
+                while (w < n)
+                    w *= 2;
+                counters.assign(depth * w, 0);
+                width = w;
+                samples = 0;
+            }
+
+            inline size_t FrequencySketch::index(size_t hash, size_t row) const noexcept {
+                uint64_t h = uint64_t(hash) + (row + 1) * 0x9e3779b97f4a7c15ull;
+                h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ull;
+                h = (h ^ (h >> 27)) * 0x94d049bb133111ebull;
+                h ^= h >> 31;
+                return row * width + size_t(h & (width - 1));
+            }
+
+    }
+
+    // A policy keeps the table's entries in one or more intrusive queues.
+    // The table calls add() for a new entry, touch() on a cache hit, erase()
+    // when an entry is removed for any reason, and victim() repeatedly while
+    // the table is over capacity, evicting each entry it returns.
+
+    class LruPolicy {
+    public:
+        static constexpr size_t queues = 1;
+        void reset(size_t /*cap*/) noexcept { main.clear(); }
+        void add(RS_Detail::CacheLink* x) { main.push_back(x); }
+        void touch(RS_Detail::CacheLink* x) noexcept { main.move_to_back(x); }
+        void erase(RS_Detail::CacheLink* x) noexcept { main.remove(x); }
+        RS_Detail::CacheLink* victim() noexcept { return main.front(); }
+        RS_Detail::CacheQueue& queue(size_t /*i*/) noexcept { return main; }
+        const RS_Detail::CacheQueue& queue(size_t /*i*/) const noexcept { return main; }
+    private:
+        RS_Detail::CacheQueue main;
+    };
+
+    class TwoQueuePolicy {
+    public:
+        static constexpr size_t queues = 2;
+        void reset(size_t cap) noexcept;
+        void add(RS_Detail::CacheLink* x) noexcept;
+        void touch(RS_Detail::CacheLink* x) noexcept { if (x->queue == hot) lists[hot].move_to_back(x); }
+        void erase(RS_Detail::CacheLink* x) noexcept { lists[x->queue].remove(x); }
+        RS_Detail::CacheLink* victim();
+        RS_Detail::CacheQueue& queue(size_t i) noexcept { return lists[i]; }
+        const RS_Detail::CacheQueue& queue(size_t i) const noexcept { return lists[i]; }
+    private:
+        static constexpr int recent = 0; // A1in: FIFO of entries seen once
+        static constexpr int hot = 1; // Am: LRU of entries seen again after leaving A1in
+        RS_Detail::CacheQueue lists[queues];
+        std::deque<std::pair<size_t, size_t>> ghost_queue; // A1out: (hash, cost) of entries evicted from A1in
+        std::unordered_map<size_t, size_t> ghost_count;
+        size_t ghost_total = 0;
+        size_t recent_cap = 0;
+        size_t ghost_cap = 0;
+    };
+
+        inline void TwoQueuePolicy::reset(size_t cap) noexcept {
+            for (auto& q: lists)
+                q.clear();
+            ghost_queue.clear();
+            ghost_count.clear();
+            ghost_total = 0;
+            recent_cap = std::max(cap / 4, size_t(1));
+            ghost_cap = std::max(cap / 2, size_t(1));
+        }
+
+        inline void TwoQueuePolicy::add(RS_Detail::CacheLink* x) noexcept {
+            auto ghost_iter = ghost_count.find(x->hash);
+            x->queue = ghost_iter == ghost_count.end() ? recent : hot;
+            if (x->queue == hot)
+                ghost_count.erase(ghost_iter);
+            lists[x->queue].push_back(x);
+        }
+
+        inline RS_Detail::CacheLink* TwoQueuePolicy::victim() {
+            if (lists[hot].empty() || lists[recent].cost() > recent_cap) {
+                auto x = lists[recent].front();
+                if (! x)
+                    return lists[hot].front();
+                ghost_queue.push_back({x->hash, x->cost});
+                ++ghost_count[x->hash];
+                ghost_total += x->cost;
+                while (ghost_total > ghost_cap && ! ghost_queue.empty()) {
+                    auto ghost_iter = ghost_count.find(ghost_queue.front().first);
+                    if (ghost_iter != ghost_count.end() && --ghost_iter->second == 0)
+                        ghost_count.erase(ghost_iter);
+                    ghost_total -= ghost_queue.front().second;
+                    ghost_queue.pop_front();
+                }
+                return x;
+            }
+            return lists[hot].front();
+        }
+
+    class TinyLfuPolicy {
+    public:
+        static constexpr size_t queues = 3;
+        TinyLfuPolicy() = default;
+        TinyLfuPolicy(const TinyLfuPolicy& p): lists(), sketch(p.sketch), window_cap(p.window_cap), protected_cap(p.protected_cap), candidate(nullptr) {}
+        TinyLfuPolicy(TinyLfuPolicy&& p) = default;
+        ~TinyLfuPolicy() noexcept = default;
+        TinyLfuPolicy& operator=(const TinyLfuPolicy& p) { if (&p != this) { TinyLfuPolicy temp(p); *this = std::move(temp); } return *this; }
+        TinyLfuPolicy& operator=(TinyLfuPolicy&& p) = default;
+        void reset(size_t cap) noexcept;
+        void add(RS_Detail::CacheLink* x);
+        void touch(RS_Detail::CacheLink* x) noexcept;
+        void erase(RS_Detail::CacheLink* x) noexcept;
+        RS_Detail::CacheLink* victim() noexcept;
+        RS_Detail::CacheQueue& queue(size_t i) noexcept { return lists[i]; }
+        const RS_Detail::CacheQueue& queue(size_t i) const noexcept { return lists[i]; }
+    private:
+        static constexpr int window = 0; // Small LRU admission window
+        static constexpr int probation = 1; // Main SLRU segment for entries seen once in main
+        static constexpr int protect = 2; // Main SLRU segment for entries hit while in main
+        RS_Detail::CacheQueue lists[queues];
+        RS_Detail::FrequencySketch sketch;
+        size_t window_cap = 1;
+        size_t protected_cap = 1;
+        RS_Detail::CacheLink* candidate = nullptr;
+    };
+
+        inline void TinyLfuPolicy::reset(size_t cap) noexcept {
+            for (auto& q: lists)
+                q.clear();
+            sketch.clear();
+            window_cap = std::max(cap / 100, size_t(1));
+            size_t main_cap = cap - std::min(cap, window_cap);
+            protected_cap = main_cap - main_cap / 5;
+            candidate = nullptr;
+        }
+
+        inline void TinyLfuPolicy::add(RS_Detail::CacheLink* x) {
+            size_t entries = lists[window].size() + lists[probation].size() + lists[protect].size() + 1;
+            sketch.reserve(2 * entries);
+            sketch.increment(x->hash);
+            x->queue = window;
+            lists[window].push_back(x);
+            candidate = nullptr;
+        }
+
+        inline void TinyLfuPolicy::touch(RS_Detail::CacheLink* x) noexcept {
+            sketch.increment(x->hash);
+            if (x->queue == probation) {
+                lists[probation].remove(x);
+                x->queue = protect;
+                lists[protect].push_back(x);
+                while (lists[protect].cost() > protected_cap && lists[protect].size() > 1) {
+                    auto y = lists[protect].front();
+                    lists[protect].remove(y);
+                    y->queue = probation;
+                    lists[probation].push_back(y);
+                }
+            } else {
+                lists[x->queue].move_to_back(x);
+            }
+        }
+
+        inline void TinyLfuPolicy::erase(RS_Detail::CacheLink* x) noexcept {
+            lists[x->queue].remove(x);
+            if (x == candidate)
+                candidate = nullptr;
+        }
+
+        inline RS_Detail::CacheLink* TinyLfuPolicy::victim() noexcept {
+            // Entries overflowing the window move to probation, and the most
+            // recent of them competes for admission against the main LRU
+            // victim; whichever is less frequently used is evicted.
+            while (lists[window].cost() > window_cap && lists[window].size() > 1) {
+                auto x = lists[window].front();
+                lists[window].remove(x);
+                x->queue = probation;
+                lists[probation].push_back(x);
+                candidate = x;
+            }
+            auto main_victim = lists[probation].front();
+            if (! main_victim)
+                main_victim = lists[protect].front();
+            if (! main_victim)
+                return lists[window].front();
+            if (! candidate || candidate == main_victim)
+                return main_victim;
+            if (sketch.estimate(candidate->hash) > sketch.estimate(main_victim->hash))
+                return main_victim;
+            return candidate;
+        }
+
+    namespace RS_Detail {
+
+        // Hash table of cached results. Entries never move once inserted, so
+        // the policy's queues are threaded through them, and hits, inserts,
+        // and evictions are all O(1). A second list in insertion order lets
+        // expired entries be swept from the front, since with a fixed TTL
+        // that is also expiry order.
+
+        template <typename K, typename V, typename H, typename P>
+        class CacheTable {
+        public:
+            using clock_type = ReliableClock;
+            using cost_function = std::function<size_t(const V&)>;
+            CacheTable() { policy.reset(cap); }
+            explicit CacheTable(size_t n): map(), cap(n) { policy.reset(cap); }
+            CacheTable(const CacheTable& t);
+            CacheTable(CacheTable&& t) noexcept;
+            ~CacheTable() noexcept = default;
+            CacheTable& operator=(const CacheTable& t) { if (&t != this) { CacheTable temp(t); *this = std::move(temp); } return *this; }
+            CacheTable& operator=(CacheTable&& t) noexcept;
+            size_t capacity() const noexcept { return cap; }
+            void clear() noexcept;
+            const V* find(const K& k);
+            void insert(K k, V v);
+            void set_cost(cost_function f);
+            void set_ttl(clock_type::duration t) noexcept { ttl = t; }
+            size_t size() const noexcept { return map.size(); }
+            CacheStats stats() const noexcept;
+        private:
+            struct entry_type:
+            CacheLink {
+                V value;
+                const K* key = nullptr;
+                clock_type::time_point expiry = clock_type::time_point::max();
+                entry_type* before = nullptr; // Toward the earliest inserted
+                entry_type* after = nullptr; // Toward the latest inserted
+                explicit entry_type(V&& v): value(std::move(v)) {}
+            };
+            using map_type = std::unordered_map<K, entry_type, H>;
+            map_type map;
+            P policy;
+            size_t cap = 0;
+            size_t total = 0;
+            cost_function cost_fun;
+            clock_type::duration ttl = clock_type::duration::zero();
+            CacheStats counts;
+            entry_type* first_added = nullptr;
+            entry_type* last_added = nullptr;
+            entry_type* add_entry(K k, V v, size_t c, clock_type::time_point exp);
+            void discard(entry_type* e) noexcept;
+            void evict_excess();
+            void link_added(entry_type* e) noexcept;
+            void remove(entry_type* e) noexcept { policy.erase(e); discard(e); }
+            void sweep(clock_type::time_point now) noexcept;
+        };
+
+            template <typename K, typename V, typename H, typename P>
+            CacheTable<K, V, H, P>::CacheTable(const CacheTable& t):
+            map(), policy(t.policy), cap(t.cap), total(0), cost_fun(t.cost_fun), ttl(t.ttl), counts(t.counts) {
+                map.reserve(t.map.size());
+                for (auto e = t.first_added; e; e = e->after)
+                    link_added(add_entry(*e->key, e->value, e->cost, e->expiry));
+                for (size_t i = 0; i < P::queues; ++i) {
+                    for (auto x = t.policy.queue(i).front(); x; x = x->next) {
+                        auto f = &map.find(*static_cast<entry_type*>(x)->key)->second;
+                        f->hash = x->hash;
+                        f->queue = x->queue;
+                        policy.queue(i).push_back(f);
+                    }
+                }
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            CacheTable<K, V, H, P>::CacheTable(CacheTable&& t) noexcept:
+            map(std::move(t.map)), policy(std::move(t.policy)), cap(t.cap), total(t.total), cost_fun(std::move(t.cost_fun)), ttl(t.ttl),
+            counts(t.counts), first_added(t.first_added), last_added(t.last_added) {
+                t.clear();
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            CacheTable<K, V, H, P>& CacheTable<K, V, H, P>::operator=(CacheTable&& t) noexcept {
+                if (&t != this) {
+                    map = std::move(t.map);
+                    policy = std::move(t.policy);
+                    cap = t.cap;
+                    total = t.total;
+                    cost_fun = std::move(t.cost_fun);
+                    ttl = t.ttl;
+                    counts = t.counts;
+                    first_added = t.first_added;
+                    last_added = t.last_added;
+                    t.clear();
+                }
+                return *this;
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::clear() noexcept {
+                map.clear();
+                policy.reset(cap);
+                total = 0;
+                first_added = last_added = nullptr;
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            const V* CacheTable<K, V, H, P>::find(const K& k) {
+                auto map_iter = map.find(k);
+                if (map_iter == map.end()) {
+                    ++counts.misses;
+                    return nullptr;
+                }
+                auto e = &map_iter->second;
+                if (e->expiry != clock_type::time_point::max() && clock_type::now() >= e->expiry) {
+                    ++counts.expiries;
+                    ++counts.misses;
+                    remove(e);
+                    return nullptr;
+                }
+                ++counts.hits;
+                policy.touch(e);
+                return &e->value;
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::insert(K k, V v) {
+                if (cap == 0)
+                    return;
+                auto map_iter = map.find(k);
+                if (map_iter != map.end()) {
+                    policy.touch(&map_iter->second);
+                    return;
+                }
+                size_t c = cost_fun ? cost_fun(v) : 1;
+                if (c > cap)
+                    return;
+                auto exp = clock_type::time_point::max();
+                if (ttl > clock_type::duration::zero()) {
+                    auto now = clock_type::now();
+                    sweep(now);
+                    exp = now + ttl;
+                }
+                size_t hash = H()(k);
+                auto e = add_entry(std::move(k), std::move(v), c, exp);
+                e->hash = hash;
+                link_added(e);
+                try { policy.add(e); }
+                catch (...) { discard(e); throw; }
+                evict_excess();
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::set_cost(cost_function f) {
+                cost_fun = f;
+                total = 0;
+                std::vector<CacheLink*> links;
+                for (size_t i = 0; i < P::queues; ++i) {
+                    auto& q = policy.queue(i);
+                    links.clear();
+                    for (auto x = q.front(); x; x = x->next)
+                        links.push_back(x);
+                    q.clear();
+                    for (auto x: links) {
+                        x->cost = cost_fun ? cost_fun(static_cast<entry_type*>(x)->value) : 1;
+                        total += x->cost;
+                        q.push_back(x);
+                    }
+                }
+                evict_excess();
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            CacheStats CacheTable<K, V, H, P>::stats() const noexcept {
+                auto s = counts;
+                s.entries = map.size();
+                s.cost = total;
+                return s;
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            typename CacheTable<K, V, H, P>::entry_type* CacheTable<K, V, H, P>::add_entry(K k, V v, size_t c, clock_type::time_point exp) {
+                auto map_iter = map.emplace(std::piecewise_construct, std::forward_as_tuple(std::move(k)), std::forward_as_tuple(std::move(v))).first;
+                auto e = &map_iter->second;
+                e->key = &map_iter->first;
+                e->cost = c;
+                e->expiry = exp;
+                total += c;
+                return e;
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::evict_excess() {
+                while (total > cap && ! map.empty()) {
+                    auto e = static_cast<entry_type*>(policy.victim());
+                    ++counts.evictions;
+                    remove(e);
+                }
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::link_added(entry_type* e) noexcept {
+                e->before = last_added;
+                e->after = nullptr;
+                if (last_added)
+                    last_added->after = e;
+                else
+                    first_added = e;
+                last_added = e;
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::discard(entry_type* e) noexcept {
+                if (e->before)
+                    e->before->after = e->after;
+                else
+                    first_added = e->after;
+                if (e->after)
+                    e->after->before = e->before;
+                else
+                    last_added = e->before;
+                total -= e->cost;
+                map.erase(map.find(*e->key));
+            }
+
+            template <typename K, typename V, typename H, typename P>
+            void CacheTable<K, V, H, P>::sweep(clock_type::time_point now) noexcept {
+                while (first_added && first_added->expiry <= now) {
+                    ++counts.expiries;
+                    remove(first_added);
+                }
+            }
+
+    }
+
+    // Function cache
+
+    template <typename Signature, typename Policy = LruPolicy> class Cache;
+
+    template <typename Policy, typename Result, typename... Args>
+    class Cache<Result(Args...), Policy> {
     public:
         using argument_tuple = std::tuple<Args...>;
+        using cost_function = std::function<size_t(const Result&)>;
         using function_type = std::function<Result(Args...)>;
         using result_type = Result;
         Cache() = default;
-        template <typename F> explicit Cache(F f, size_t n = npos): log(), map(), fun(f), cap(n) {}
+        template <typename F> explicit Cache(F f, size_t n = npos): table(n), fun(f) {}
         Result operator()(Args... args);
-        void clear() noexcept { log.clear(); map.clear(); }
+        void clear() noexcept { table.clear(); }
+        void set_cost(cost_function f) { table.set_cost(f); }
+        template <typename R, typename P> void set_ttl(std::chrono::duration<R, P> t) noexcept
+            { table.set_ttl(std::chrono::duration_cast<ReliableClock::duration>(t)); }
+        size_t size() const noexcept { return table.size(); }
+        CacheStats stats() const noexcept { return table.stats(); }
     private:
-        using cache_log = std::deque<const argument_tuple*>;
-        struct cache_entry {
-            Result result;
-            typename cache_log::iterator log_iter;
-        };
-        using cache_map = std::unordered_map<argument_tuple, cache_entry, TupleHash<argument_tuple>>;
-        cache_log log;
-        cache_map map;
+        using table_type = RS_Detail::CacheTable<argument_tuple, Result, TupleHash<argument_tuple>, Policy>;
+        table_type table;
         function_type fun;
-        size_t cap = 0;
     };
 
-        template <typename Result, typename... Args>
-        Result Cache<Result(Args...)>::operator()(Args... args) {
+        template <typename Policy, typename Result, typename... Args>
+        Result Cache<Result(Args...), Policy>::operator()(Args... args) {
             argument_tuple tup{args...};
-            auto map_iter = map.find(tup);
-            bool insert = map_iter == map.end();
-            log.push_back(nullptr);
-            ScopeFailure guard([&] { log.pop_back(); });
-            if (insert)
-                map_iter = map.insert({tup, {tuple_invoke(fun, tup), {}}}).first;
-            log.back() = &map_iter->first;
-            if (! insert)
-                log.erase(map_iter->second.log_iter);
-            map_iter->second.log_iter = std::prev(log.end());
-            if (insert && map.size() > cap) {
-                map.erase(*log.front());
-                log.pop_front();
-            }
-            return map_iter->second.result;
-        }
-
-    template <typename F>
+            auto ptr = table.find(tup);
+            if (ptr)
+                return *ptr;
+            Result result = tuple_invoke(fun, tup);
+            table.insert(std::move(tup), result);
+            return result;
+        }
+
+    template <typename Policy = LruPolicy, typename F>
     auto memoize(F f, size_t n = npos) {
-        return Cache<FunctionSignature<F>>(f, n);
+        return Cache<FunctionSignature<F>, Policy>(f, n);
+    }
+
+    // Thread safe function cache
+
+    template <typename Signature, typename Policy = LruPolicy> class ConcurrentCache;
+
+    template <typename Policy, typename Result, typename... Args>
+    class ConcurrentCache<Result(Args...), Policy> {
+    public:
+        RS_MOVE_ONLY(ConcurrentCache);
+        using argument_tuple = std::tuple<Args...>;
+        using cost_function = std::function<size_t(const Result&)>;
+        using function_type = std::function<Result(Args...)>;
+        using future_type = std::shared_future<Result>;
+        using result_type = Result;
+        ConcurrentCache() = default;
+        template <typename F> explicit ConcurrentCache(F f, size_t n = npos, size_t shards = 0, bool single_flight = false);
+        Result operator()(Args... args);
+        future_type async(Args... args);
+        void clear() noexcept;
+        void set_cost(cost_function f);
+        template <typename R, typename P> void set_ttl(std::chrono::duration<R, P> t) noexcept
+            { set_ttl_impl(std::chrono::duration_cast<ReliableClock::duration>(t)); }
+        size_t shards() const noexcept { return nshards; }
+        bool single_flight() const noexcept { return flight; }
+        size_t size() const noexcept { return stats().entries; }
+        CacheStats stats() const noexcept;
+        static size_t default_shards() noexcept { return 4 * Thread::cpu_threads(); }
+    private:
+        using hash_type = TupleHash<argument_tuple>;
+        using table_type = RS_Detail::CacheTable<argument_tuple, Result, hash_type, Policy>;
+        struct pending_type {
+            std::promise<Result> promise;
+            future_type future;
+        };
+        using pending_map = std::unordered_map<argument_tuple, pending_type, hash_type>;
+        struct alignas(64) shard_type {
+            Mutex mutex;
+            table_type table;
+            pending_map pending;
+        };
+        std::unique_ptr<shard_type[]> shard_array;
+        size_t nshards = 0;
+        function_type fun;
+        bool flight = false;
+        shard_type& get_shard(const argument_tuple& tup) const noexcept { return shard_array[hash_type()(tup) % nshards]; }
+        future_type start_pending(shard_type& shard, const argument_tuple& tup);
+        void run_pending(shard_type& shard, const argument_tuple& tup);
+        void set_ttl_impl(ReliableClock::duration t) noexcept;
+    };
+
+        template <typename Policy, typename Result, typename... Args>
+        template <typename F>
+        ConcurrentCache<Result(Args...), Policy>::ConcurrentCache(F f, size_t n, size_t shards, bool single_flight):
+        shard_array(), nshards(shards), fun(f), flight(single_flight) {
+            if (nshards == 0)
+                nshards = default_shards();
+            if (n != npos && nshards > n)
+                nshards = std::max(n, size_t(1));
+            size_t shard_cap = n == npos ? npos : (n + nshards - 1) / nshards;
+            shard_array.reset(new shard_type[nshards]);
+            for (size_t i = 0; i < nshards; ++i)
+                shard_array[i].table = table_type(shard_cap);
+        }
+
+        template <typename Policy, typename Result, typename... Args>
+        Result ConcurrentCache<Result(Args...), Policy>::operator()(Args... args) {
+            argument_tuple tup{args...};
+            if (nshards == 0)
+                return tuple_invoke(fun, tup);
+            auto& shard = get_shard(tup);
+            future_type fut;
+            bool owner = false;
+            {
+                MutexLock lock(shard.mutex);
+                auto ptr = shard.table.find(tup);
+                if (ptr)
+                    return *ptr;
+                if (flight) {
+                    auto pend_iter = shard.pending.find(tup);
+                    owner = pend_iter == shard.pending.end();
+                    fut = owner ? start_pending(shard, tup) : pend_iter->second.future;
+                }
+            }
+            if (! flight) {
+                Result result = tuple_invoke(fun, tup);
+                MutexLock lock(shard.mutex);
+                shard.table.insert(std::move(tup), result);
+                return result;
+            }
+            if (owner)
+                run_pending(shard, tup);
+            return fut.get();
+        }
+
+        template <typename Policy, typename Result, typename... Args>
+        typename ConcurrentCache<Result(Args...), Policy>::future_type ConcurrentCache<Result(Args...), Policy>::async(Args... args) {
+            argument_tuple tup{args...};
+            if (nshards == 0) {
+                std::promise<Result> prom;
+                try { prom.set_value(tuple_invoke(fun, tup)); }
+                catch (...) { prom.set_exception(std::current_exception()); }
+                return prom.get_future().share();
+            }
+            auto& shard = get_shard(tup);
+            future_type fut;
+            {
+                MutexLock lock(shard.mutex);
+                auto ptr = shard.table.find(tup);
+                if (ptr) {
+                    std::promise<Result> prom;
+                    prom.set_value(*ptr);
+                    return prom.get_future().share();
+                }
+                auto pend_iter = shard.pending.find(tup);
+                if (pend_iter != shard.pending.end())
+                    return pend_iter->second.future;
+                fut = start_pending(shard, tup);
+            }
+            run_pending(shard, tup);
+            return fut;
+        }
+
+        template <typename Policy, typename Result, typename... Args>
+        void ConcurrentCache<Result(Args...), Policy>::clear() noexcept {
+            for (size_t i = 0; i < nshards; ++i) {
+                MutexLock lock(shard_array[i].mutex);
+                shard_array[i].table.clear();
+            }
+        }
+
+        template <typename Policy, typename Result, typename... Args>
+        void ConcurrentCache<Result(Args...), Policy>::set_cost(cost_function f) {
+            for (size_t i = 0; i < nshards; ++i) {
+                MutexLock lock(shard_array[i].mutex);
+                shard_array[i].table.set_cost(f);
+            }
+        }
+
+        template <typename Policy, typename Result, typename... Args>
+        CacheStats ConcurrentCache<Result(Args...), Policy>::stats() const noexcept {
+            CacheStats s;
+            for (size_t i = 0; i < nshards; ++i) {
+                MutexLock lock(shard_array[i].mutex);
+                s += shard_array[i].table.stats();
+            }
+            return s;
+        }
+
+        template <typename Policy, typename Result, typename... Args>
+        void ConcurrentCache<Result(Args...), Policy>::set_ttl_impl(ReliableClock::duration t) noexcept {
+            for (size_t i = 0; i < nshards; ++i) {
+                MutexLock lock(shard_array[i].mutex);
+                shard_array[i].table.set_ttl(t);
+            }
+        }
+
+        // Called with the shard locked
+
+        template <typename Policy, typename Result, typename... Args>
+        typename ConcurrentCache<Result(Args...), Policy>::future_type
+        ConcurrentCache<Result(Args...), Policy>::start_pending(shard_type& shard, const argument_tuple& tup) {
+            auto& pend = shard.pending[tup];
+            pend.future = pend.promise.get_future().share();
+            return pend.future;
+        }
+
+        // Called with the shard unlocked, only by the thread that created
+        // the pending entry. Exceptions are passed to every waiting caller
+        // through the shared future, but the failure is not cached.
+
+        template <typename Policy, typename Result, typename... Args>
+        void ConcurrentCache<Result(Args...), Policy>::run_pending(shard_type& shard, const argument_tuple& tup) {
+            std::promise<Result> prom;
+            try {
+                Result result = tuple_invoke(fun, tup);
+                {
+                    MutexLock lock(shard.mutex);
+                    auto pend_iter = shard.pending.find(tup);
+                    prom = std::move(pend_iter->second.promise);
+                    shard.pending.erase(pend_iter);
+                    shard.table.insert(tup, result);
+                }
+                prom.set_value(std::move(result));
+            }
+            catch (...) {
+                {
+                    MutexLock lock(shard.mutex);
+                    auto pend_iter = shard.pending.find(tup);
+                    if (pend_iter != shard.pending.end()) {
+                        prom = std::move(pend_iter->second.promise);
+                        shard.pending.erase(pend_iter);
+                    }
+                }
+                prom.set_exception(std::current_exception());
+            }
+        }
+
+    template <typename Policy = LruPolicy, typename F>
+    auto concurrent_memoize(F f, size_t n = npos, size_t shards = 0, bool single_flight = false) {
+        return ConcurrentCache<FunctionSignature<F>, Policy>(f, n, shards, single_flight);
+    }
+
+    // Asynchronous function cache
+
+    template <typename Signature, typename Policy = LruPolicy> class AsyncCache;
+
+    template <typename Policy, typename Result, typename... Args>
+    class AsyncCache<Result(Args...), Policy> {
+    public:
+        RS_MOVE_ONLY(AsyncCache);
+        using argument_tuple = std::tuple<Args...>;
+        using cost_function = std::function<size_t(const Result&)>;
+        using function_type = std::function<Result(Args...)>;
+        using future_type = std::shared_future<Result>;
+        using result_type = Result;
+        AsyncCache() = default;
+        template <typename F> explicit AsyncCache(F f, size_t n = npos, size_t shards = 0): cache(f, n, shards, true) {}
+        future_type operator()(Args... args) { return cache.async(args...); }
+        void clear() noexcept { cache.clear(); }
+        void set_cost(cost_function f) { cache.set_cost(f); }
+        template <typename R, typename P> void set_ttl(std::chrono::duration<R, P> t) noexcept { cache.set_ttl(t); }
+        size_t shards() const noexcept { return cache.shards(); }
+        size_t size() const noexcept { return cache.size(); }
+        CacheStats stats() const noexcept { return cache.stats(); }
+    private:
+        ConcurrentCache<Result(Args...), Policy> cache;
+    };
+
+    template <typename Policy = LruPolicy, typename F>
+    auto async_memoize(F f, size_t n = npos, size_t shards = 0) {
+        return AsyncCache<FunctionSignature<F>, Policy>(f, n, shards);
     }
 
 }
@@ -1922,6 +1922,23 @@ namespace {
         TRY(u = djb2a(s0.data(), s0.size()));  TEST_EQUAL(u, 0x00001505);
         TRY(u = djb2a(s1.data(), s1.size()));  TEST_EQUAL(u, 0x33c13465);
 
+        uint64_t w1 = 0, w2 = 0;
+        std::string s2(1000, 'a');
+
+        TRY(w1 = wyhash(nullptr, 10));               TEST_EQUAL(w1, wyhash(s0.data(), 0));
+        TRY(w1 = wyhash(s1.data(), s1.size()));      TEST_EQUAL(w1, wyhash(s1.data(), s1.size()));
+        TRY(w2 = wyhash(s1.data(), s1.size(), 42));  TEST_COMPARE(w1, !=, w2);
+        TRY(w2 = wyhash(s1.data(), s1.size() - 1));  TEST_COMPARE(w1, !=, w2);
+
+        for (size_t n = 1; n <= s2.size(); n += n < 64 ? 1 : 37) {
+            TRY(w1 = wyhash(s2.data(), n));
+            TRY(s2[n - 1] = 'b');
+            TRY(w2 = wyhash(s2.data(), n));
+            TRY(s2[n - 1] = 'a');
+            TEST_COMPARE(w1, !=, w2);
+            TEST_COMPARE(w1, !=, wyhash(s2.data(), n - 1));
+        }
+
         TRY(hash_combine(h1, 42));
         TRY(hash_combine(h2, 42, s1));
         TRY(hash_combine(h3, 86, 99, s1));
@@ -1363,6 +1363,80 @@ namespace RS {
         return d;
     }
 
+    // wyhash() is based on Wang Yi's wyhash (final version 4)
+    // https://github.com/wangyi-fudan/wyhash
+
+    namespace RS_Detail {
+
+        inline void wy_multiply(uint64_t& a, uint64_t& b) noexcept {
+            #ifdef __SIZEOF_INT128__
+                auto r = static_cast<unsigned __int128>(a) * b;
+                a = uint64_t(r);
+                b = uint64_t(r >> 64);
+            #else
+                uint64_t ha = a >> 32, hb = b >> 32, la = uint32_t(a), lb = uint32_t(b);
+                uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb, t = rl + (rm0 << 32);
+                uint64_t c = t < rl, lo = t + (rm1 << 32);
+                c += lo < t;
+                a = lo;
+                b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+            #endif
+        }
+
+        inline uint64_t wy_mix(uint64_t a, uint64_t b) noexcept {
+            wy_multiply(a, b);
+            return a ^ b;
+        }
+
+        inline uint64_t wy_read8(const uint8_t* p) noexcept { return LittleEndian<uint64_t>(p); }
+        inline uint64_t wy_read4(const uint8_t* p) noexcept { return LittleEndian<uint32_t>(p); }
+        inline uint64_t wy_read3(const uint8_t* p, size_t n) noexcept { return (uint64_t(p[0]) << 16) | (uint64_t(p[n >> 1]) << 8) | p[n - 1]; }
+
+    }
+
+    inline uint64_t wyhash(const void* ptr, size_t n, uint64_t seed = 0) noexcept {
+        using namespace RS_Detail;
+        static constexpr uint64_t secret[] = {0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull, 0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull};
+        auto p = static_cast<const uint8_t*>(ptr);
+        if (! p)
+            n = 0;
+        seed ^= wy_mix(seed ^ secret[0], secret[1]);
+        uint64_t a = 0, b = 0;
+        if (n <= 16) {
+            if (n >= 4) {
+                size_t k = (n >> 3) << 2;
+                a = (wy_read4(p) << 32) | wy_read4(p + k);
+                b = (wy_read4(p + n - 4) << 32) | wy_read4(p + n - 4 - k);
+            } else if (n > 0) {
+                a = wy_read3(p, n);
+            }
+        } else {
+            size_t i = n;
+            if (i >= 48) {
+                uint64_t see1 = seed, see2 = seed;
+                do {
+                    seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+                    see1 = wy_mix(wy_read8(p + 16) ^ secret[2], wy_read8(p + 24) ^ see1);
+                    see2 = wy_mix(wy_read8(p + 32) ^ secret[3], wy_read8(p + 40) ^ see2);
+                    p += 48;
+                    i -= 48;
+                } while (i >= 48);
+                seed ^= see1 ^ see2;
+            }
+            while (i > 16) {
+                seed = wy_mix(wy_read8(p) ^ secret[1], wy_read8(p + 8) ^ seed);
+                p += 16;
+                i -= 16;
+            }
+            a = wy_read8(p + i - 16);
+            b = wy_read8(p + i - 8);
+        }
+        a ^= secret[1];
+        b ^= seed;
+        wy_multiply(a, b);
+        return wy_mix(a ^ secret[0] ^ n, b ^ secret[1]);
+    }
+
     inline void hash_combine(size_t&) noexcept {}
 
     template <typename T>
@@ -0,0 +1,219 @@
+#include "rs-core/flat-map.hpp"
+#include "rs-core/string.hpp"
+#include "rs-core/unit-test.hpp"
+#include <algorithm>
+#include <functional>
+#include <memory>
+#include <random>
+#include <string>
+#include <string_view>
+#include <unordered_set>
+#include <utility>
+#include <vector>
+
+using namespace RS;
+
+namespace {
+
+    struct TransparentHash {
+        using is_transparent = void;
+        size_t operator()(std::string_view s) const noexcept { return std::hash<std::string_view>()(s); }
+    };
+
+    struct TransparentEqual {
+        using is_transparent = void;
+        bool operator()(std::string_view a, std::string_view b) const noexcept { return a == b; }
+    };
+
+    template <typename M>
+    U8string sorted_str(const M& m) {
+        std::vector<typename M::key_type> keys;
+        for (auto& v: m)
+            keys.push_back(v.first);
+        std::sort(keys.begin(), keys.end());
+        U8string s;
+        for (auto& k: keys)
+            s += to_str(k) + ":" + to_str(m.find(k)->second) + ",";
+        if (! s.empty())
+            s.pop_back();
+        return "{" + s + "}";
+    }
+
+    void check_flat_map() {
+
+        FlatMap<int, U8string> map;
+        FlatMap<int, U8string>::iterator i;
+        U8string s;
+
+        TEST(map.empty());
+        TEST_EQUAL(map.size(), 0);
+        TEST_EQUAL(map.capacity(), 0);
+        TEST(! map.has(10));
+        TEST(map.begin() == map.end());
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{}");
+
+        TEST(map.insert({30, "hello"}).second);
+        TEST(! map.empty());
+        TEST_EQUAL(map.size(), 1);
+        TEST_EQUAL(map.capacity(), 14);
+        TEST(map.has(30));
+        TEST(! map.has(20));
+        TRY(s = to_str(map));
+        TEST_EQUAL(s, "{30:hello}");
+
+        TEST(map.insert({20, "world"}).second);
+        TEST(map.insert({10, "goodbye"}).second);
+        TEST_EQUAL(map.size(), 3);
+        TEST(map.has(30));
+        TEST(map.has(20));
+        TEST(map.has(10));
+        TRY(s = sorted_str(map));
+        TEST_EQUAL(s, "{10:goodbye,20:world,30:hello}");
+
+        TRY(map[30] = "foo");
+        TRY(map[40] = "bar");
+        TEST_EQUAL(map.size(), 4);
+        TRY(s = sorted_str(map));
+        TEST_EQUAL(s, "{10:goodbye,20:world,30:foo,40:bar}");
+
+        auto rc = map.insert({30, "hello again"});
+        TEST(! rc.second);
+        REQUIRE(rc.first != map.end());
+        TEST_EQUAL(rc.first->second, "foo");
+        TEST_EQUAL(map.size(), 4);
+
+        TRY(i = map.find(10));
+        REQUIRE(i != map.end());
+        TEST_EQUAL(i->first, 10);
+        TEST_EQUAL(i->second, "goodbye");
+        TRY(i = map.find(50));
+        TEST(i == map.end());
+
+        TEST(map.erase(20));
+        TEST(! map.erase(20));
+        TEST_EQUAL(map.size(), 3);
+        TRY(s = sorted_str(map));
+        TEST_EQUAL(s, "{10:goodbye,30:foo,40:bar}");
+
+        TRY(i = map.find(30));
+        REQUIRE(i != map.end());
+        TRY(map.erase(i));
+        TEST_EQUAL(map.size(), 2);
+        TRY(s = sorted_str(map));
+        TEST_EQUAL(s, "{10:goodbye,40:bar}");
+
+        FlatMap<int, U8string> copy;
+        TRY(copy = map);
+        TEST_EQUAL(copy.size(), 2);
+        TRY(s = sorted_str(copy));
+        TEST_EQUAL(s, "{10:goodbye,40:bar}");
+        TRY(map.clear());
+        TEST(map.empty());
+        TEST(map.begin() == map.end());
+        TEST(! map.has(10));
+        TRY(map = std::move(copy));
+        TRY(s = sorted_str(map));
+        TEST_EQUAL(s, "{10:goodbye,40:bar}");
+
+        TRY((map = {{1, "a"}, {2, "b"}, {3, "c"}, {1, "d"}}));
+        TEST_EQUAL(map.size(), 3);
+        TRY(s = sorted_str(map));
+        TEST_EQUAL(s, "{1:a,2:b,3:c}");
+
+    }
+
+    void check_flat_set() {
+
+        FlatSet<int> set;
+        std::unordered_set<int> ref;
+        std::mt19937 rng(42);
+        std::uniform_int_distribution<int> dist(0, 999);
+
+        TEST(set.empty());
+        TEST_EQUAL(set.size(), 0);
+
+        for (int j = 0; j < 10000; ++j) {
+            int k = dist(rng);
+            if (j % 3 == 2)
+                TEST_EQUAL(set.erase(k), ref.erase(k) == 1);
+            else
+                TEST_EQUAL(set.insert(k).second, ref.insert(k).second);
+        }
+
+        TEST_EQUAL(set.size(), ref.size());
+        for (int k = 0; k < 1000; ++k)
+            TEST_EQUAL(set.has(k), ref.count(k) == 1);
+
+        std::vector<int> v1(set.begin(), set.end()), v2(ref.begin(), ref.end());
+        std::sort(v1.begin(), v1.end());
+        std::sort(v2.begin(), v2.end());
+        TEST(v1 == v2);
+
+        // Erasing through an iterator leaves other iterators valid
+
+        for (auto i = set.begin(); i != set.end(); ++i)
+            if (*i % 2)
+                set.erase(i);
+        for (int k: set)
+            TEST_EQUAL(k % 2, 0);
+        TEST_EQUAL(size_t(std::distance(set.begin(), set.end())), set.size());
+
+        TRY(set.clear());
+        TRY(set.reserve(1000));
+        size_t cap = set.capacity();
+        TEST_COMPARE(cap, >=, 1000);
+        for (int k = 0; k < 1000; ++k)
+            TRY(set.insert(k));
+        TEST_EQUAL(set.capacity(), cap);
+        TEST_EQUAL(set.size(), 1000);
+
+    }
+
+    void check_flat_map_heterogeneous() {
+
+        FlatMap<std::string, int, TransparentHash, TransparentEqual> map;
+        std::string_view sv = "world";
+
+        TRY(map["hello"] = 1);
+        TRY(map["world"] = 2);
+        TEST(map.has(sv));
+        TEST(map.has("hello"));
+        TEST(! map.has(std::string_view("goodbye")));
+        auto i = map.find(sv);
+        REQUIRE(i != map.end());
+        TEST_EQUAL(i->second, 2);
+        TEST(map.erase(sv));
+        TEST(! map.has(sv));
+        TEST_EQUAL(map.size(), 1);
+
+    }
+
+    void check_flat_map_move_only() {
+
+        FlatMap<int, std::unique_ptr<int>> map;
+
+        for (int k = 0; k < 100; ++k)
+            TEST(map.insert({k, std::make_unique<int>(k * k)}).second);
+        TEST_EQUAL(map.size(), 100);
+        TRY(map.reserve(1000));
+        TEST_EQUAL(map.size(), 100);
+        for (int k = 0; k < 100; ++k) {
+            auto i = map.find(k);
+            REQUIRE(i != map.end());
+            REQUIRE(i->second);
+            TEST_EQUAL(*i->second, k * k);
+        }
+
+    }
+
+}
+
+TEST_MODULE(core, flat_map) {
+
+    check_flat_map();
+    check_flat_set();
+    check_flat_map_heterogeneous();
+    check_flat_map_move_only();
+
+}
@@ -0,0 +1,392 @@
+#pragma once
+
+#include "rs-core/common.hpp"
+#include <algorithm>
+#include <cstring>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+#ifdef __SSE2__
+    #include <emmintrin.h>
+#endif
+
+namespace RS {
+
+    namespace RS_Detail {
+
+        template <typename K, typename T>
+        struct FlatMapTraits {
+            using value_type = std::pair<const K, T>;
+            static const K& key(const value_type& v) noexcept { return v.first; }
+        };
+
+        template <typename K>
+        struct FlatMapTraits<K, void> {
+            using value_type = K;
+            static const K& key(const K& v) noexcept { return v; }
+        };
+
+        template <typename H, typename E, typename Q, typename = void> struct FlatMapTransparent: std::false_type {};
+        template <typename H, typename E, typename Q>
+            struct FlatMapTransparent<H, E, Q, std::void_t<typename H::is_transparent, typename E::is_transparent>>: std::true_type {};
+
+        // Control bytes: 0-127 = full slot holding low 7 bits of hash,
+        // or one of these negative values
+
+        constexpr int8_t flat_empty = -128;
+        constexpr int8_t flat_deleted = -2;
+        constexpr size_t flat_group_size = 16;
+
+        class FlatGroup {
+        public:
+            explicit FlatGroup(const int8_t* p) noexcept {
+                #ifdef __SSE2__
+                    ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                #else
+                    memcpy(ctrl, p, flat_group_size);
+                #endif
+            }
+            uint32_t match(int8_t h) const noexcept {
+                #ifdef __SSE2__
+                    return _mm_movemask_epi8(_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(h)));
+                #else
+                    uint32_t mask = 0;
+                    for (size_t i = 0; i < flat_group_size; ++i)
+                        mask |= uint32_t(ctrl[i] == h) << i;
+                    return mask;
+                #endif
+            }
+            uint32_t match_empty() const noexcept { return match(flat_empty); }
+            uint32_t match_free() const noexcept {
+                // Empty or deleted
+                #ifdef __SSE2__
+                    return _mm_movemask_epi8(ctrl);
+                #else
+                    uint32_t mask = 0;
+                    for (size_t i = 0; i < flat_group_size; ++i)
+                        mask |= uint32_t(ctrl[i] < 0) << i;
+                    return mask;
+                #endif
+            }
+        private:
+            #ifdef __SSE2__
+                __m128i ctrl;
+            #else
+                int8_t ctrl[flat_group_size];
+            #endif
+        };
+
+        inline size_t flat_first_bit(uint32_t mask) noexcept {
+            #if defined(__GNUC__)
+                return __builtin_ctz(mask);
+            #else
+                size_t i = 0;
+                while (! (mask & 1)) {
+                    mask >>= 1;
+                    ++i;
+                }
+                return i;
+            #endif
+        }
+
+    }
+
+    template <typename K, typename T, typename Hash = std::hash<K>, typename Equal = std::equal_to<K>>
+    class FlatMap {
+    private:
+        using traits = RS_Detail::FlatMapTraits<K, T>;
+        template <typename Q> using if_transparent = std::enable_if_t<RS_Detail::FlatMapTransparent<Hash, Equal, Q>::value>;
+    public:
+        using key_type = K;
+        using mapped_type = T;
+        using value_type = typename traits::value_type;
+        using hasher = Hash;
+        using key_equal = Equal;
+        template <typename CV>
+        class basic_iterator:
+        public ForwardIterator<basic_iterator<CV>, CV> {
+        public:
+            basic_iterator() = default;
+            template <typename CV2> basic_iterator(const basic_iterator<CV2>& i): map(i.map), index(i.index) {}
+            CV& operator*() const noexcept { return map->slots[index]; }
+            basic_iterator& operator++() noexcept { index = map->next_full(index + 1); return *this; }
+            bool operator==(const basic_iterator& rhs) const noexcept { return index == rhs.index; }
+        private:
+            friend class FlatMap;
+            template <typename CV2> friend class basic_iterator;
+            using map_type = std::conditional_t<std::is_const<CV>::value, const FlatMap, FlatMap>;
+            map_type* map = nullptr;
+            size_t index = 0;
+            basic_iterator(map_type* m, size_t i) noexcept: map(m), index(i) {}
+        };
+        using const_iterator = basic_iterator<const value_type>;
+        using iterator = basic_iterator<std::conditional_t<std::is_void<T>::value, const value_type, value_type>>;
+        FlatMap() = default;
+        FlatMap(std::initializer_list<value_type> list) { reserve(list.size()); for (auto& v: list) insert(v); }
+        explicit FlatMap(const Hash& h, const Equal& e = {}): hash_fn(h), equal_fn(e) {}
+        ~FlatMap() noexcept { deallocate(); }
+        FlatMap(const FlatMap& m);
+        FlatMap(FlatMap&& m) noexcept: FlatMap() { swap(m); }
+        FlatMap& operator=(const FlatMap& m) { FlatMap temp(m); swap(temp); return *this; }
+        FlatMap& operator=(FlatMap&& m) noexcept { FlatMap temp(std::move(m)); swap(temp); return *this; }
+        template <typename T2 = T> std::enable_if_t<! std::is_void<T2>::value, T2&> operator[](const K& k); // map only
+        iterator begin() noexcept { return {this, next_full(0)}; }
+        const_iterator begin() const noexcept { return {this, next_full(0)}; }
+        iterator end() noexcept { return {this, cap}; }
+        const_iterator end() const noexcept { return {this, cap}; }
+        size_t capacity() const noexcept { return cap - cap / 8; }
+        void clear() noexcept;
+        bool empty() const noexcept { return count == 0; }
+        bool erase(const K& k) noexcept { return erase_key(k); }
+        template <typename Q, typename = if_transparent<Q>> bool erase(const Q& q) noexcept { return erase_key(q); }
+        void erase(const_iterator i) noexcept { erase_index(i.index); }
+        Hash hash_function() const { return hash_fn; }
+        Equal key_eq() const { return equal_fn; }
+        iterator find(const K& k) noexcept { return {this, find_index(k)}; }
+        const_iterator find(const K& k) const noexcept { return {this, find_index(k)}; }
+        template <typename Q, typename = if_transparent<Q>> iterator find(const Q& q) noexcept { return {this, find_index(q)}; }
+        template <typename Q, typename = if_transparent<Q>> const_iterator find(const Q& q) const noexcept { return {this, find_index(q)}; }
+        bool has(const K& k) const noexcept { return find_index(k) != cap; }
+        template <typename Q, typename = if_transparent<Q>> bool has(const Q& q) const noexcept { return find_index(q) != cap; }
+        template <typename... Args> std::pair<iterator, bool> emplace(Args&&... args) { return insert(value_type(std::forward<Args>(args)...)); }
+        std::pair<iterator, bool> insert(const value_type& v) { return insert_value(v); }
+        std::pair<iterator, bool> insert(value_type&& v) { return insert_value(std::move(v)); }
+        void reserve(size_t n);
+        size_t size() const noexcept { return count; }
+        void swap(FlatMap& m) noexcept;
+        friend void swap(FlatMap& a, FlatMap& b) noexcept { a.swap(b); }
+    private:
+        int8_t* ctrl = nullptr;
+        value_type* slots = nullptr;
+        size_t cap = 0; // Number of slots, zero or a power of 2 multiple of the group size
+        size_t count = 0;
+        size_t growth_left = 0;
+        Hash hash_fn;
+        Equal equal_fn;
+        void allocate(size_t n);
+        void deallocate() noexcept;
+        template <typename Q> bool erase_key(const Q& q) noexcept;
+        void erase_index(size_t i) noexcept;
+        template <typename Q> size_t find_index(const Q& q) const noexcept { return find_index(q, hash_of(q)); }
+        template <typename Q> size_t find_index(const Q& q, size_t hash) const noexcept;
+        size_t find_free(size_t hash) const noexcept;
+        template <typename Q> size_t hash_of(const Q& q) const noexcept;
+        template <typename... Args> size_t insert_new(size_t hash, Args&&... args);
+        template <typename V> std::pair<iterator, bool> insert_value(V&& v);
+        size_t next_full(size_t i) const noexcept;
+        void rehash(size_t n);
+        static int8_t h2(size_t hash) noexcept { return int8_t(hash & 0x7f); }
+        static size_t slots_for(size_t n) noexcept;
+    };
+
+    template <typename K, typename Hash = std::hash<K>, typename Equal = std::equal_to<K>> using FlatSet = FlatMap<K, void, Hash, Equal>;
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    FlatMap<K, T, Hash, Equal>::FlatMap(const FlatMap& m):
+    hash_fn(m.hash_fn), equal_fn(m.equal_fn) {
+        reserve(m.count);
+        for (auto& v: m)
+            insert_new(hash_of(traits::key(v)), v);
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    template <typename T2>
+    std::enable_if_t<! std::is_void<T2>::value, T2&> FlatMap<K, T, Hash, Equal>::operator[](const K& k) {
+        size_t hash = hash_of(k);
+        size_t i = find_index(k, hash);
+        if (i == cap)
+            i = insert_new(hash, std::piecewise_construct, std::forward_as_tuple(k), std::forward_as_tuple());
+        return slots[i].second;
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::clear() noexcept {
+        for (size_t i = 0; i < cap; ++i) {
+            if (ctrl[i] >= 0)
+                slots[i].~value_type();
+            ctrl[i] = RS_Detail::flat_empty;
+        }
+        count = 0;
+        growth_left = capacity();
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::reserve(size_t n) {
+        if (n > capacity())
+            rehash(n);
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::swap(FlatMap& m) noexcept {
+        using std::swap;
+        swap(ctrl, m.ctrl);
+        swap(slots, m.slots);
+        swap(cap, m.cap);
+        swap(count, m.count);
+        swap(growth_left, m.growth_left);
+        swap(hash_fn, m.hash_fn);
+        swap(equal_fn, m.equal_fn);
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::allocate(size_t n) {
+        // Control bytes go after the slots in the same allocation
+        std::unique_ptr<unsigned char[]> block(new unsigned char[n * sizeof(value_type) + n]);
+        slots = reinterpret_cast<value_type*>(block.get());
+        ctrl = reinterpret_cast<int8_t*>(block.release() + n * sizeof(value_type));
+        std::fill(ctrl, ctrl + n, RS_Detail::flat_empty);
+        cap = n;
+        count = 0;
+        growth_left = capacity();
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::deallocate() noexcept {
+        if (! cap)
+            return;
+        for (size_t i = 0; i < cap; ++i)
+            if (ctrl[i] >= 0)
+                slots[i].~value_type();
+        delete[] reinterpret_cast<unsigned char*>(slots);
+        ctrl = nullptr;
+        slots = nullptr;
+        cap = count = growth_left = 0;
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    template <typename Q>
+    bool FlatMap<K, T, Hash, Equal>::erase_key(const Q& q) noexcept {
+        size_t i = find_index(q);
+        if (i == cap)
+            return false;
+        erase_index(i);
+        return true;
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::erase_index(size_t i) noexcept {
+        using namespace RS_Detail;
+        slots[i].~value_type();
+        --count;
+        // If the group still has an empty slot, no probe sequence can have
+        // passed through it, so the slot can be marked empty again
+        if (FlatGroup(ctrl + i / flat_group_size * flat_group_size).match_empty()) {
+            ctrl[i] = flat_empty;
+            ++growth_left;
+        } else {
+            ctrl[i] = flat_deleted;
+        }
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    template <typename Q>
+    size_t FlatMap<K, T, Hash, Equal>::find_index(const Q& q, size_t hash) const noexcept {
+        using namespace RS_Detail;
+        if (count == 0)
+            return cap;
+        size_t mask = cap / flat_group_size - 1;
+        size_t group = (hash >> 7) & mask;
+        auto tag = h2(hash);
+        for (size_t step = 1;; ++step) {
+            size_t base = group * flat_group_size;
+            FlatGroup g(ctrl + base);
+            for (uint32_t bits = g.match(tag); bits; bits &= bits - 1) {
+                size_t i = base + flat_first_bit(bits);
+                if (equal_fn(traits::key(slots[i]), q))
+                    return i;
+            }
+            if (g.match_empty())
+                return cap;
+            group = (group + step) & mask;
+        }
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    size_t FlatMap<K, T, Hash, Equal>::find_free(size_t hash) const noexcept {
+        using namespace RS_Detail;
+        size_t mask = cap / flat_group_size - 1;
+        size_t group = (hash >> 7) & mask;
+        for (size_t step = 1;; ++step) {
+            size_t base = group * flat_group_size;
+            uint32_t bits = FlatGroup(ctrl + base).match_free();
+            if (bits)
+                return base + flat_first_bit(bits);
+            group = (group + step) & mask;
+        }
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    template <typename Q>
+    size_t FlatMap<K, T, Hash, Equal>::hash_of(const Q& q) const noexcept {
+        // Many standard hashes are the identity function for integers, so
+        // mix the bits before splitting the hash into group and tag
+        uint64_t h = uint64_t(hash_fn(q)) * 0x9e3779b97f4a7c15ull;
+        return size_t(h ^ (h >> 32));
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    template <typename... Args>
+    size_t FlatMap<K, T, Hash, Equal>::insert_new(size_t hash, Args&&... args) {
+        // Caller has already checked that the key is not present
+        if (growth_left == 0)
+            rehash(count + 1);
+        size_t i = find_free(hash);
+        new (slots + i) value_type(std::forward<Args>(args)...);
+        if (ctrl[i] == RS_Detail::flat_empty)
+            --growth_left;
+        ctrl[i] = h2(hash);
+        ++count;
+        return i;
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    template <typename V>
+    std::pair<typename FlatMap<K, T, Hash, Equal>::iterator, bool> FlatMap<K, T, Hash, Equal>::insert_value(V&& v) {
+        size_t hash = hash_of(traits::key(v));
+        size_t i = find_index(traits::key(v), hash);
+        if (i != cap)
+            return {iterator(this, i), false};
+        i = insert_new(hash, std::forward<V>(v));
+        return {iterator(this, i), true};
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    size_t FlatMap<K, T, Hash, Equal>::next_full(size_t i) const noexcept {
+        while (i < cap && ctrl[i] < 0)
+            ++i;
+        return i;
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    void FlatMap<K, T, Hash, Equal>::rehash(size_t n) {
+        // Rebuild into a new table large enough for n elements, which also
+        // clears out any deleted slots
+        FlatMap temp(hash_fn, equal_fn);
+        temp.allocate(slots_for(std::max(n, count)));
+        for (size_t i = 0; i < cap; ++i) {
+            if (ctrl[i] >= 0) {
+                size_t hash = hash_of(traits::key(slots[i]));
+                size_t j = temp.find_free(hash);
+                new (temp.slots + j) value_type(std::move_if_noexcept(slots[i]));
+                temp.ctrl[j] = h2(hash);
+                ++temp.count;
+                --temp.growth_left;
+            }
+        }
+        swap(temp);
+    }
+
+    template <typename K, typename T, typename Hash, typename Equal>
+    size_t FlatMap<K, T, Hash, Equal>::slots_for(size_t n) noexcept {
+        // Smallest power of 2 number of slots with a load factor of at most 7/8
+        size_t slots = RS_Detail::flat_group_size;
+        while (slots - slots / 8 < n)
+            slots *= 2;
+        return slots;
+    }
+
+}
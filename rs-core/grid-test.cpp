@@ -1,17 +1,24 @@
 #include "rs-core/grid.hpp"
+#include "rs-core/blob.hpp"
+#include "rs-core/file.hpp"
 #include "rs-core/string.hpp"
 #include "rs-core/unit-test.hpp"
 #include <algorithm>
+#include <functional>
+#include <iterator>
+#include <numeric>
 #include <sstream>
 #include <stdexcept>
 #include <string>
+#include <system_error>
+#include <vector>
 
 using namespace RS;
 
 namespace {
 
-    template <typename T, size_t N>
-    U8string grid_format_helper(const Grid<T, N>& g, Vector<ptrdiff_t, N> index, size_t current) {
+    template <typename T, size_t N, GridLayout L>
+    U8string grid_format_helper(const Grid<T, N, L>& g, Vector<ptrdiff_t, N> index, size_t current) {
         std::ostringstream out;
         out << "[";
         ptrdiff_t n = g.shape()[current];
@@ -30,8 +37,8 @@ namespace {
         return str;
     }
 
-    template <typename T, size_t N>
-    U8string grid_format(const Grid<T, N>& g) {
+    template <typename T, size_t N, GridLayout L>
+    U8string grid_format(const Grid<T, N, L>& g) {
         Vector<ptrdiff_t, N> index;
         std::fill(index.begin(), index.end(), 0);
         return grid_format_helper(g, index, 0);
@@ -119,6 +126,13 @@ namespace {
         TEST_EQUAL(to_str(ig.shape()), "[2,5]");
         TEST_EQUAL(grid_format(ig), "[[100,101,102,0,0],[110,111,112,0,0]]");
 
+        TRY(ig.reshape({3, 5}, 9));
+        TEST_EQUAL(ig.size(), 15);
+        TEST_EQUAL(to_str(ig.shape()), "[3,5]");
+        TEST_EQUAL(grid_format(ig), "[[100,101,102,0,0],[110,111,112,0,0],[9,9,9,9,9]]");
+        TRY(ig.reshape(2, 5));
+        TEST_EQUAL(grid_format(ig), "[[100,101,102,0,0],[110,111,112,0,0]]");
+
         TRY(ig4.reset(2, 3, 2, 3));
         TEST_EQUAL(ig4.size(), 36);
         TEST_EQUAL(to_str(ig4.shape()), "[2,3,2,3]");
@@ -152,10 +166,343 @@ namespace {
 
     }
 
+    template <GridLayout L>
+    void check_grid_layout_3d() {
+
+        using grid_type = Grid<int, 3, L>;
+        using index_type = typename grid_type::index_type;
+
+        grid_type g(5, 7, 3);
+        typename grid_type::iterator i;
+
+        TEST_EQUAL(g.size(), 105);
+        for (int x = 0; x < 5; ++x)
+            for (int y = 0; y < 7; ++y)
+                for (int z = 0; z < 3; ++z)
+                    TRY(g(x, y, z) = 100 * x + 10 * y + z);
+
+        Grid<int, 3> ref(5, 7, 3);
+        for (int x = 0; x < 5; ++x)
+            for (int y = 0; y < 7; ++y)
+                for (int z = 0; z < 3; ++z)
+                    TRY(ref.at(x, y, z) = 100 * x + 10 * y + z);
+        TEST_EQUAL(grid_format(g), grid_format(ref));
+
+        // Every element is visited exactly once, and pos() agrees with the value
+
+        std::vector<int> seen;
+        for (i = g.begin(); i != g.end(); ++i) {
+            index_type p = i.pos();
+            TEST_EQUAL(*i, 100 * p[0] + 10 * p[1] + p[2]);
+            seen.push_back(*i);
+        }
+        std::vector<int> expect(ref.begin(), ref.end());
+        std::sort(seen.begin(), seen.end());
+        TEST(seen == expect);
+
+        TRY(i = g.locate(2, 3, 1));
+        TEST_EQUAL(*i, 231);
+        TRY(i.move(1, 3));
+        TEST_EQUAL(*i, 261);
+        TRY(i.move(0, -10));
+        TRY(i.move(2, 5));
+        TRY(i.move(0, 12));
+        TRY(i.move(2, -6));
+        TEST_EQUAL(*i, 460);
+        TEST_EQUAL(to_str(i.pos()), "[4,6,0]");
+
+        TRY(g.reshape(3, 9, 2));
+        TEST_EQUAL(g.size(), 54);
+        TEST_EQUAL(g(2, 6, 1), 261);
+        TEST_EQUAL(g(2, 7, 1), 0);
+        TEST_EQUAL(g(1, 2, 0), 120);
+        TEST_EQUAL(size_t(std::distance(g.begin(), g.end())), g.size());
+        TEST_THROW(g.at(3, 0, 0), std::out_of_range);
+
+        grid_type h = g;
+        TEST(h == g);
+        TRY(h(0, 0, 0) = -1);
+        TEST(h != g);
+
+    }
+
+    void check_grid_layouts() {
+
+        Grid<int, 2> rg(4, 6);
+        Grid<int, 2, GridLayout::tiled> tg(4, 6);
+        Grid<int, 2, GridLayout::morton> mg(4, 6);
+
+        for (int x = 0; x < 4; ++x) {
+            for (int y = 0; y < 6; ++y) {
+                TRY(rg(x, y) = 10 * x + y);
+                TRY(tg(x, y) = 10 * x + y);
+                TRY(mg(x, y) = 10 * x + y);
+            }
+        }
+
+        TEST_EQUAL(to_str(rg.block_shape()), "[1,1]");
+        TEST_EQUAL(to_str(tg.block_shape()), "[4,4]");
+        TEST_EQUAL(to_str(mg.block_shape()), "[4,4]");
+        TEST_EQUAL(grid_format(tg), grid_format(rg));
+        TEST_EQUAL(grid_format(mg), grid_format(rg));
+        TEST_EQUAL(to_str(rg), "[0,1,2,3,4,5,10,11,12,13,14,15,20,21,22,23,24,25,30,31,32,33,34,35]");
+        TEST_EQUAL(to_str(tg), "[0,1,2,3,10,11,12,13,20,21,22,23,30,31,32,33,4,5,14,15,24,25,34,35]");
+        TEST_EQUAL(to_str(mg), "[0,1,10,11,2,3,12,13,20,21,30,31,22,23,32,33,4,5,14,15,24,25,34,35]");
+
+        Grid<double, 2, GridLayout::tiled> big_tiled(1000, 1000);
+        Grid<float, 3, GridLayout::tiled> big_tiled_3d(100, 100, 100);
+        Grid<float, 2, GridLayout::morton> big_morton(300, 1000);
+        TEST_EQUAL(to_str(big_tiled.block_shape()), "[16,16]");
+        TEST_EQUAL(to_str(big_tiled_3d.block_shape()), "[8,8,8]");
+        TEST_EQUAL(to_str(big_morton.block_shape()), "[512,512]");
+
+        Grid<int, 4> rg4(3, 2, 3, 2);
+        Grid<int, 4, GridLayout::morton> mg4(3, 2, 3, 2);
+        for (int w = 0; w < 3; ++w)
+            for (int x = 0; x < 2; ++x)
+                for (int y = 0; y < 3; ++y)
+                    for (int z = 0; z < 2; ++z)
+                        TRY(rg4(w, x, y, z) = mg4(w, x, y, z) = 1000 * w + 100 * x + 10 * y + z);
+        TEST_EQUAL(grid_format(mg4), grid_format(rg4));
+        TEST_EQUAL(to_str(mg4.block_shape()), "[2,2,2,2]");
+        TEST_EQUAL(size_t(std::distance(mg4.begin(), mg4.end())), 36);
+
+        check_grid_layout_3d<GridLayout::tiled>();
+        check_grid_layout_3d<GridLayout::morton>();
+
+    }
+
+    template <typename T, size_t N>
+    U8string view_format(const GridView<T, N>& v) {
+        U8string s;
+        for (auto& x: v)
+            s += to_str(x) + ",";
+        if (! s.empty())
+            s.pop_back();
+        return "[" + s + "]";
+    }
+
+    void check_grid_views() {
+
+        Grid<int, 2> g(4, 5);
+        for (int x = 0; x < 4; ++x)
+            for (int y = 0; y < 5; ++y)
+                TRY(g(x, y) = 10 * x + y);
+
+        GridView<int, 2> v;
+        ConstGridView<int, 2> cv;
+        GridView<int, 1> v1;
+        GridView<int, 2>::iterator i;
+
+        TEST(v.empty());
+        TEST_EQUAL(v.size(), 0);
+        TEST(v.begin() == v.end());
+
+        TRY(v = g.view());
+        TEST_EQUAL(to_str(v.shape()), "[4,5]");
+        TEST_EQUAL(to_str(v.strides()), "[5,1]");
+        TEST_EQUAL(v.size(), 20);
+        TEST_EQUAL(v(2, 3), 23);
+        TEST_EQUAL(view_format(v), to_str(g));
+
+        TRY(v = g.view().slice({1, 1}, {2, 3}));
+        TEST_EQUAL(to_str(v.shape()), "[2,3]");
+        TEST_EQUAL(view_format(v), "[11,12,13,21,22,23]");
+        TEST_EQUAL(v(0, 0), 11);
+        TEST_EQUAL(v.at(1, 2), 23);
+        TEST_THROW(v.at(2, 0), std::out_of_range);
+        TEST(v.contains(1, 2));
+        TEST(! v.contains(1, 3));
+        TEST(! v.contains(-1, 0));
+        TEST_THROW(g.view().slice({3, 0}, {2, 1}), std::out_of_range);
+
+        TRY(v(0, 0) = 99);
+        TEST_EQUAL(g(1, 1), 99);
+        TRY(v(0, 0) = 11);
+
+        TRY(i = v.begin());
+        TRY(i.move(0, 1));
+        TRY(i.move(1, 2));
+        TEST_EQUAL(*i, 23);
+        TEST_EQUAL(to_str(i.pos()), "[1,2]");
+
+        TRY(v = g.view().transpose(0, 1));
+        TEST_EQUAL(to_str(v.shape()), "[5,4]");
+        TEST_EQUAL(v(3, 1), 13);
+        TEST_EQUAL(view_format(v), "[0,10,20,30,1,11,21,31,2,12,22,32,3,13,23,33,4,14,24,34]");
+
+        TRY(v = g.view().step(1, 2));
+        TEST_EQUAL(to_str(v.shape()), "[4,3]");
+        TEST_EQUAL(view_format(v), "[0,2,4,10,12,14,20,22,24,30,32,34]");
+        TRY(v = g.view().step(0, -3));
+        TEST_EQUAL(to_str(v.shape()), "[2,5]");
+        TEST_EQUAL(view_format(v), "[30,31,32,33,34,0,1,2,3,4]");
+        TEST_THROW(g.view().step(0, 0), std::invalid_argument);
+
+        TRY(v1 = g.view().fix(0, 2));
+        TEST_EQUAL(to_str(v1.shape()), "[5]");
+        TEST_EQUAL(view_format(v1), "[20,21,22,23,24]");
+        TRY(v1 = g.view().fix(1, 3));
+        TEST_EQUAL(view_format(v1), "[3,13,23,33]");
+        TEST_THROW(g.view().fix(1, 5), std::out_of_range);
+
+        TRY(v = g.view().slice({0, 1}, {4, 3}).step(0, 2).transpose(0, 1));
+        TEST_EQUAL(to_str(v.shape()), "[3,2]");
+        TEST_EQUAL(view_format(v), "[1,21,2,22,3,23]");
+        TRY(v.fill(-1));
+        TEST_EQUAL(to_str(g), "[0,-1,-1,-1,4,10,11,12,13,14,20,-1,-1,-1,24,30,31,32,33,34]");
+
+        const auto& cg = g;
+        TRY(cv = cg.view().slice({2, 0}, {2, 2}));
+        TEST_EQUAL(view_format(cv), "[20,-1,30,31]");
+        TRY(cv = v);
+        TEST_EQUAL(view_format(cv), "[-1,-1,-1,-1,-1,-1]");
+
+        TRY(v = g.view().slice({1, 1}, {2, 0}));
+        TEST(v.empty());
+        TEST(v.begin() == v.end());
+
+        Grid<int, 3> g3(2, 3, 4);
+        int n = 0;
+        for (auto& x: g3)
+            x = n++;
+        GridView<int, 2> v2;
+        TRY(v2 = g3.view().fix(1, 1));
+        TEST_EQUAL(view_format(v2), "[4,5,6,7,16,17,18,19]");
+        TRY(v1 = g3.view().fix(2, 3).fix(0, 1));
+        TEST_EQUAL(view_format(v1), "[15,19,23]");
+
+    }
+
+
+    void check_grid_bulk_operations() {
+
+        Grid<int, 2> g(4, 5), h;
+        U8string s;
+
+        TRY(g.for_each_index([] (auto& pos, int& x) { x = 10 * int(pos[0]) + int(pos[1]); }));
+        TEST_EQUAL(to_str(g), "[0,1,2,3,4,10,11,12,13,14,20,21,22,23,24,30,31,32,33,34]");
+        TEST_EQUAL(g.reduce(0, std::plus<int>()), 340);
+        TEST_EQUAL(g.reduce(0, std::plus<int>(), 3), 340);
+        TEST_EQUAL(g.reduce(100, [] (int a, int b) { return std::max(a, b); }, 4), 100);
+
+        TRY(h = g);
+        TRY(h.transform([] (int x) { return 2 * x; }, 3));
+        TEST_EQUAL(to_str(h), "[0,2,4,6,8,20,22,24,26,28,40,42,44,46,48,60,62,64,66,68]");
+        Grid<double, 2> d(4, 5);
+        TRY(d.transform(g, [] (int x) { return x / 2.0; }, 2));
+        TEST_EQUAL(d(3, 1), 15.5);
+        Grid<double, 2> e(5, 4);
+        TEST_THROW(e.transform(g, [] (int x) { return x; }), std::invalid_argument);
+
+        Grid<int, 2> k({3, 3}, 0);
+        TRY(k(1, 1) = 1);
+        TRY(h = g.convolve(k));
+        TEST(h == g);
+        TRY(k.reset({3, 3}, 1));
+        TRY(h = g.convolve(k, 2));
+        TEST_EQUAL(to_str(h), "[22,36,42,48,34,63,99,108,117,81,123,189,198,207,141,102,156,162,168,114]");
+        Grid<int, 1> g1(6), k1(2), h1;
+        TRY(g1.for_each_index([] (auto& pos, int& x) { x = int(pos[0]) + 1; }));
+        TRY(k1(0) = 1);
+        TRY(k1(1) = 10);
+        TRY(h1 = g1.convolve(k1));
+        TEST_EQUAL(to_str(h1), "[10,21,32,43,54,65]");
+
+        Grid<int, 3> g3(37, 19, 23), h3, h4;
+        Grid<int, 3> k3(3, 3, 3);
+        TRY(g3.for_each_index([] (auto& pos, int& x) { x = int(pos[0] * 7 + pos[1] * 3 + pos[2]) % 11; }, 4));
+        TEST_EQUAL(g3(36, 18, 22), (36 * 7 + 18 * 3 + 22) % 11);
+        TRY(k3.for_each_index([] (auto& pos, int& x) { x = int(pos[0] + 2 * pos[1] - pos[2]); }));
+        TRY(h3 = g3.convolve(k3, 1));
+        TRY(h4 = g3.convolve(k3, 4));
+        TEST(h3 == h4);
+        int expect = 0;
+        for (int i = 0; i < 3; ++i)
+            for (int j = 0; j < 3; ++j)
+                for (int l = 0; l < 3; ++l)
+                    if (4 + i >= 0 && 17 + j < 19 && 21 + l < 23)
+                        expect += k3(i, j, l) * g3(4 + i, 17 + j, 21 + l);
+        TEST_EQUAL(h3(5, 18, 22), expect);
+        TEST_EQUAL(g3.reduce(0, std::plus<int>(), 1), g3.reduce(0, std::plus<int>(), 4));
+        TEST_EQUAL(g3.reduce(0, std::plus<int>(), 100), g3.reduce(0, std::plus<int>()));
+
+    }
+
+    void check_grid_mapping() {
+
+        using IntGrid = Grid<int, 2>;
+        using MortonGrid = Grid<float, 3, GridLayout::morton>;
+
+        const File f = "__test_grid_map";
+        const File h = "__test_grid_missing";
+        IntGrid g, g2;
+        U8string s;
+
+        TRY(g = IntGrid::map_new(f, {3, 4}));
+        TEST(g.mapped());
+        TEST_EQUAL(to_str(g.shape()), "[3,4]");
+        TEST_EQUAL(to_str(g), "[0,0,0,0,0,0,0,0,0,0,0,0]");
+        TRY(g.for_each_index([] (auto& pos, int& x) { x = 10 * int(pos[0]) + int(pos[1]); }));
+        TRY(g.flush());
+        TEST_EQUAL(f.size(), 4096 + 12 * sizeof(int));
+
+        TRY(g2 = g);
+        TEST(! g2.mapped());
+        TEST(g2 == g);
+        TRY(g.clear());
+        TEST(! g.mapped());
+
+        TRY(g = IntGrid::map(f));
+        TEST(g.mapped());
+        TEST_EQUAL(to_str(g.shape()), "[3,4]");
+        TEST_EQUAL(to_str(g), "[0,1,2,3,10,11,12,13,20,21,22,23]");
+        TRY(g(1, 1) = 99);
+        TRY(g.reset());
+        TRY(g = IntGrid::map(f, Blob::map_private | Blob::map_sequential));
+        TEST_EQUAL(g(1, 1), 99);
+        TRY(g(1, 1) = 11);
+        TRY(g.reset());
+        TRY(g = IntGrid::map(f, Blob::map_random));
+        TEST_EQUAL(g(1, 1), 99);
+
+        TRY(g.reshape(4, 4));
+        TEST(! g.mapped());
+        TEST_EQUAL(to_str(g), "[0,1,2,3,10,99,12,13,20,21,22,23,0,0,0,0]");
+        TRY(g = IntGrid::map(f));
+        TEST_EQUAL(to_str(g.shape()), "[3,4]");
+        TRY(g.clear());
+
+        TEST_THROW((Grid<int, 3>::map(f)), std::runtime_error);
+        TEST_THROW((Grid<float, 2>::map(f)), std::runtime_error);
+        TEST_THROW((Grid<int, 2, GridLayout::tiled>::map(f)), std::runtime_error);
+        TEST_THROW((IntGrid::map(h)), std::system_error);
+        TRY(f.save("Hello world\n"));
+        TEST_THROW((IntGrid::map(f)), std::runtime_error);
+
+        MortonGrid m;
+        TRY(m = MortonGrid::map_new(f, {5, 6, 7}, 1.5f));
+        TEST_EQUAL(m.size(), 210);
+        TEST_EQUAL(std::accumulate(m.begin(), m.end(), 0.0f), 315.0f);
+        TRY(m(4, 5, 6) = 2.5f);
+        TRY(m.clear());
+        TRY(m = MortonGrid::map(f));
+        TEST_EQUAL(to_str(m.shape()), "[5,6,7]");
+        TEST_EQUAL(m(4, 5, 6), 2.5f);
+        TEST_EQUAL(m(0, 0, 0), 1.5f);
+        TRY(m.clear());
+
+        TRY(f.remove());
+
+    }
 }
 
 TEST_MODULE(core, grid) {
 
     check_grid();
+    check_grid_layouts();
+    check_grid_views();
+    check_grid_bulk_operations();
+    check_grid_mapping();
 
 }
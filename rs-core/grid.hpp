@@ -1,19 +1,442 @@
 #pragma once
 
+#include "rs-core/blob.hpp"
 #include "rs-core/common.hpp"
+#include "rs-core/file.hpp"
+#include "rs-core/thread.hpp"
 #include "rs-core/vector.hpp"
 #include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <limits>
 #include <numeric>
 #include <stdexcept>
+#include <system_error>
 #include <type_traits>
+#include <typeinfo>
 #include <utility>
 #include <vector>
 
+#ifdef __BMI2__
+    #include <immintrin.h>
+#endif
+
+#ifdef _XOPEN_SOURCE
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
 namespace RS {
 
+    RS_ENUM_CLASS(GridLayout, int, 1, row_major, tiled, morton);
+
+    namespace RS_Detail {
+
+        // Morton code helpers: spread inserts N-1 zero bits between each
+        // bit of x, compact reverses this
+
+        template <size_t N>
+        constexpr uint64_t grid_morton_mask() noexcept {
+            uint64_t mask = 0;
+            for (size_t i = 0; i < 64; i += N)
+                mask |= uint64_t(1) << i;
+            return mask;
+        }
+
+        template <size_t N>
+        inline uint64_t grid_morton_spread(uint64_t x) noexcept {
+            #ifdef __BMI2__
+                return _pdep_u64(x, grid_morton_mask<N>());
+            #else
+                if constexpr (N == 1) {
+                    return x;
+                } else if constexpr (N == 2) {
+                    x &= 0xffffffffull;
+                    x = (x | (x << 16)) & 0x0000ffff0000ffffull;
+                    x = (x | (x << 8)) & 0x00ff00ff00ff00ffull;
+                    x = (x | (x << 4)) & 0x0f0f0f0f0f0f0f0full;
+                    x = (x | (x << 2)) & 0x3333333333333333ull;
+                    x = (x | (x << 1)) & 0x5555555555555555ull;
+                    return x;
+                } else if constexpr (N == 3) {
+                    x &= 0x1fffffull;
+                    x = (x | (x << 32)) & 0x001f00000000ffffull;
+                    x = (x | (x << 16)) & 0x001f0000ff0000ffull;
+                    x = (x | (x << 8)) & 0x100f00f00f00f00full;
+                    x = (x | (x << 4)) & 0x10c30c30c30c30c3ull;
+                    x = (x | (x << 2)) & 0x1249249249249249ull;
+                    return x;
+                } else {
+                    uint64_t y = 0;
+                    for (size_t i = 0; i < 64 / N; ++i)
+                        y |= ((x >> i) & 1) << (N * i);
+                    return y;
+                }
+            #endif
+        }
+
+        template <size_t N>
+        inline uint64_t grid_morton_compact(uint64_t x) noexcept {
+            #ifdef __BMI2__
+                return _pext_u64(x, grid_morton_mask<N>());
+            #else
+                if constexpr (N == 1) {
+                    return x;
+                } else if constexpr (N == 2) {
+                    x &= 0x5555555555555555ull;
+                    x = (x | (x >> 1)) & 0x3333333333333333ull;
+                    x = (x | (x >> 2)) & 0x0f0f0f0f0f0f0f0full;
+                    x = (x | (x >> 4)) & 0x00ff00ff00ff00ffull;
+                    x = (x | (x >> 8)) & 0x0000ffff0000ffffull;
+                    x = (x | (x >> 16)) & 0xffffffffull;
+                    return x;
+                } else if constexpr (N == 3) {
+                    x &= 0x1249249249249249ull;
+                    x = (x | (x >> 2)) & 0x10c30c30c30c30c3ull;
+                    x = (x | (x >> 4)) & 0x100f00f00f00f00full;
+                    x = (x | (x >> 8)) & 0x001f0000ff0000ffull;
+                    x = (x | (x >> 16)) & 0x001f00000000ffffull;
+                    x = (x | (x >> 32)) & 0x1fffffull;
+                    return x;
+                } else {
+                    uint64_t y = 0;
+                    for (size_t i = 0; i < 64 / N; ++i)
+                        y |= ((x >> (N * i)) & 1) << i;
+                    return y;
+                }
+            #endif
+        }
+
+        // Grid file layout: a fixed header, followed by the extents as
+        // int64_t[N], padded to a whole page; the elements start on the
+        // next page in storage order
+
+        struct GridFileHeader {
+            char magic[8];
+            uint32_t version;
+            uint32_t dims;
+            uint32_t layout;
+            uint32_t element_size;
+            uint64_t element_type;
+        };
+
+        constexpr char grid_file_magic[8] = "RS:GRID";
+        constexpr uint32_t grid_file_version = 1;
+        constexpr size_t grid_file_header_size = 4096;
+
+        // Map a grid file read/write; if n is zero, open an existing file and
+        // map all of it, otherwise create or truncate the file to n bytes
+
+        #ifdef _XOPEN_SOURCE
+
+            inline Blob grid_map_file(const File& f, size_t n, uint32_t flags) {
+                bool create = n != 0;
+                bool priv = ! create && (flags & Blob::map_private);
+                errno = 0;
+                int fd = create ? ::open(f.c_name(), O_RDWR | O_CREAT | O_TRUNC, 0666) : ::open(f.c_name(), priv ? O_RDONLY : O_RDWR);
+                int err = errno;
+                if (fd == -1)
+                    throw std::system_error(err, std::generic_category(), f.name());
+                ScopeExit guard([=] { ::close(fd); });
+                int rc = 0;
+                errno = 0;
+                if (create) {
+                    rc = ::ftruncate(fd, off_t(n));
+                } else {
+                    struct stat st;
+                    rc = ::fstat(fd, &st);
+                    if (rc == 0 && uint64_t(st.st_size) > uint64_t(std::numeric_limits<size_t>::max()))
+                        throw std::length_error("File is too large to map: " + f.name());
+                    n = st.st_size;
+                }
+                err = errno;
+                if (rc)
+                    throw std::system_error(err, std::generic_category(), f.name());
+                if (n == 0)
+                    return {};
+                errno = 0;
+                void* p = ::mmap(nullptr, n, PROT_READ | PROT_WRITE, priv ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+                err = errno;
+                if (p == MAP_FAILED)
+                    throw std::system_error(err, std::generic_category(), f.name());
+                if (flags & Blob::map_random)
+                    ::posix_madvise(p, n, POSIX_MADV_RANDOM);
+                else if (flags & Blob::map_sequential)
+                    ::posix_madvise(p, n, POSIX_MADV_SEQUENTIAL);
+                return Blob(p, n, [n] (void* ptr) { ::munmap(ptr, n); });
+            }
+
+            inline void grid_flush_file(Blob& b) {
+                errno = 0;
+                int rc = ::msync(b.data(), b.size(), MS_SYNC);
+                int err = errno;
+                if (rc)
+                    throw std::system_error(err, std::generic_category());
+            }
+
+        #else
+
+            inline Blob grid_map_file(const File& f, size_t n, uint32_t flags) {
+                bool create = n != 0;
+                bool priv = ! create && (flags & Blob::map_private);
+                DWORD hint = 0;
+                if (flags & Blob::map_random)
+                    hint = FILE_FLAG_RANDOM_ACCESS;
+                else if (flags & Blob::map_sequential)
+                    hint = FILE_FLAG_SEQUENTIAL_SCAN;
+                auto wpath = f.native();
+                DWORD access = priv ? GENERIC_READ : GENERIC_READ | GENERIC_WRITE;
+                HANDLE fh = CreateFileW(wpath.data(), access, FILE_SHARE_READ, nullptr, create ? CREATE_ALWAYS : OPEN_EXISTING, hint, nullptr);
+                if (fh == INVALID_HANDLE_VALUE)
+                    throw std::system_error(GetLastError(), windows_category(), f.name());
+                ScopeExit fguard([=] { CloseHandle(fh); });
+                LARGE_INTEGER li;
+                if (create) {
+                    li.QuadPart = n;
+                } else {
+                    if (! GetFileSizeEx(fh, &li))
+                        throw std::system_error(GetLastError(), windows_category(), f.name());
+                    if (uint64_t(li.QuadPart) > uint64_t(std::numeric_limits<size_t>::max()))
+                        throw std::length_error("File is too large to map: " + f.name());
+                    n = li.QuadPart;
+                    if (n == 0)
+                        return {};
+                }
+                // Mapping more than the current file size extends the file
+                DWORD protect = priv ? PAGE_WRITECOPY : PAGE_READWRITE;
+                HANDLE mh = CreateFileMappingW(fh, nullptr, protect, li.HighPart, li.LowPart, nullptr);
+                if (! mh)
+                    throw std::system_error(GetLastError(), windows_category(), f.name());
+                ScopeExit mguard([=] { CloseHandle(mh); });
+                void* p = MapViewOfFile(mh, priv ? FILE_MAP_COPY : FILE_MAP_WRITE, 0, 0, n);
+                if (! p)
+                    throw std::system_error(GetLastError(), windows_category(), f.name());
+                return Blob(p, n, [] (void* ptr) { UnmapViewOfFile(ptr); });
+            }
+
+            inline void grid_flush_file(Blob& b) {
+                if (! FlushViewOfFile(b.data(), b.size()))
+                    throw std::system_error(GetLastError(), windows_category());
+            }
+
+        #endif
+
+        // Element storage for Grid: either an owned vector or part of a
+        // mapped file. Elements are always accessed through ptr, so there
+        // is no extra cost for either. Copying always produces an owned
+        // vector.
+
+        template <typename T>
+        class GridStorage {
+        public:
+            GridStorage() = default;
+            explicit GridStorage(size_t n): vec(n) { sync(); }
+            GridStorage(size_t n, const T& t): vec(n, t) { sync(); }
+            GridStorage(Blob&& b, size_t offset, size_t n) noexcept:
+                map(std::move(b)), ptr(reinterpret_cast<T*>(map.bdata() + offset)), len(n) {}
+            ~GridStorage() = default;
+            GridStorage(const GridStorage& s): vec(s.begin(), s.end()) { sync(); }
+            GridStorage(GridStorage&& s) noexcept: vec(std::move(s.vec)), map(std::move(s.map)), ptr(s.ptr), len(s.len) { s.release(); }
+            GridStorage& operator=(const GridStorage& s) { GridStorage t(s); return *this = std::move(t); }
+            GridStorage& operator=(GridStorage&& s) noexcept;
+            T& operator[](size_t i) noexcept { return ptr[i]; }
+            const T& operator[](size_t i) const noexcept { return ptr[i]; }
+            T* begin() noexcept { return ptr; }
+            const T* begin() const noexcept { return ptr; }
+            T* end() noexcept { return ptr + len; }
+            const T* end() const noexcept { return ptr + len; }
+            void clear() noexcept { vec.clear(); map.clear(); sync(); }
+            T* data() noexcept { return ptr; }
+            const T* data() const noexcept { return ptr; }
+            bool empty() const noexcept { return len == 0; }
+            void flush() { if (! map.empty()) grid_flush_file(map); }
+            bool mapped() const noexcept { return ! map.empty(); }
+            void resize(size_t n, const T& t);
+            size_t size() const noexcept { return len; }
+        private:
+            std::vector<T> vec;
+            Blob map; // The whole file, including the header
+            T* ptr = nullptr;
+            size_t len = 0;
+            void release() noexcept { vec.clear(); map.clear(); sync(); }
+            void sync() noexcept { ptr = vec.data(); len = vec.size(); }
+        };
+
+        template <typename T>
+        GridStorage<T>& GridStorage<T>::operator=(GridStorage&& s) noexcept {
+            if (&s != this) {
+                vec = std::move(s.vec);
+                map = std::move(s.map);
+                ptr = s.ptr;
+                len = s.len;
+                s.release();
+            }
+            return *this;
+        }
+
+        template <typename T>
+        void GridStorage<T>::resize(size_t n, const T& t) {
+            // A mapped file can't be resized in place, so copy the elements
+            // into memory first
+            if (mapped()) {
+                std::vector<T> v(ptr, ptr + std::min(n, len));
+                map.clear();
+                vec = std::move(v);
+            }
+            vec.resize(n, t);
+            sync();
+        }
+
+    }
+
+    template <typename T, size_t N>
+    class GridView {
+    public:
+        using index_type = Vector<ptrdiff_t, N>;
+        class iterator:
+        public ForwardIterator<iterator, T> {
+        public:
+            iterator() = default;
+            T& operator*() const noexcept { return *ptr; }
+            iterator& operator++() noexcept;
+            bool operator==(const iterator& rhs) const noexcept { return ptr == rhs.ptr && where[0] == rhs.where[0]; }
+            void move(size_t axis, ptrdiff_t delta) noexcept { ptr += delta * stride[axis]; where[axis] += delta; }
+            index_type pos() const { return where; }
+        private:
+            friend class GridView;
+            T* ptr = nullptr;
+            index_type where;
+            index_type extent;
+            index_type stride;
+            iterator(T* p, const index_type& w, const index_type& e, const index_type& s) noexcept: ptr(p), where(w), extent(e), stride(s) {}
+        };
+        using const_iterator = iterator;
+        using difference_type = ptrdiff_t;
+        using reference = T&;
+        using size_type = size_t;
+        using value_type = std::remove_const_t<T>;
+        static constexpr size_t dim = N;
+        GridView() = default;
+        GridView(T* ptr, const index_type& shape, const index_type& strides) noexcept: origin(ptr), extent(shape), stride(strides) {}
+        template <typename U, typename = std::enable_if_t<std::is_same<const U, T>::value && ! std::is_same<U, T>::value>>
+            GridView(const GridView<U, N>& v) noexcept: origin(v.data()), extent(v.shape()), stride(v.strides()) {}
+        T& operator[](const index_type& pos) const noexcept { return origin[get_offset(pos)]; }
+        template <typename... Args> T& operator()(Args... pos) const noexcept { return origin[get_offset(index_type{pos...})]; }
+        T& at(const index_type& pos) const;
+        template <typename... Args> T& at(Args... pos) const { return at(index_type{pos...}); }
+        iterator begin() const noexcept { return empty() ? end() : iterator(origin, index_type(), extent, stride); }
+        bool contains(const index_type& pos) const noexcept;
+        template <typename... Args> bool contains(Args... pos) const noexcept { return contains(index_type{pos...}); }
+        T* data() const noexcept { return origin; }
+        bool empty() const noexcept { return std::find(extent.begin(), extent.end(), 0) != extent.end(); }
+        iterator end() const noexcept;
+        void fill(const value_type& t) const { std::fill(begin(), end(), t); }
+        template <size_t M = N> std::enable_if_t<(M > 1), GridView<T, M - 1>> fix(size_t axis, ptrdiff_t pos) const;
+        index_type shape() const noexcept { return extent; }
+        size_t size() const noexcept { return std::accumulate(extent.begin(), extent.end(), size_t(1), std::multiplies<size_t>()); }
+        GridView slice(const index_type& pos, const index_type& shape) const;
+        GridView step(size_t axis, ptrdiff_t delta) const;
+        index_type strides() const noexcept { return stride; }
+        GridView transpose(size_t axis1, size_t axis2) const noexcept;
+    private:
+        static_assert(N > 0);
+        T* origin = nullptr;
+        index_type extent;
+        index_type stride;
+        ptrdiff_t get_offset(const index_type& pos) const noexcept { return std::inner_product(pos.begin(), pos.end(), stride.begin(), ptrdiff_t(0)); }
+    };
+
+    template <typename T, size_t N> using ConstGridView = GridView<const T, N>;
+
+    template <typename T, size_t N>
+    typename GridView<T, N>::iterator& GridView<T, N>::iterator::operator++() noexcept {
+        // Odometer increment; end() is the first position past the last row
+        size_t i = N - 1;
+        ptr += stride[i];
+        while (++where[i] == extent[i] && i > 0) {
+            ptr -= extent[i] * stride[i];
+            where[i] = 0;
+            --i;
+            ptr += stride[i];
+        }
+        return *this;
+    }
+
+    template <typename T, size_t N>
+    T& GridView<T, N>::at(const index_type& pos) const {
+        if (! contains(pos))
+            throw std::out_of_range("Grid index out of range");
+        return origin[get_offset(pos)];
+    }
+
+    template <typename T, size_t N>
+    bool GridView<T, N>::contains(const index_type& pos) const noexcept {
+        for (size_t i = 0; i < N; ++i)
+            if (pos[i] < 0 || pos[i] >= extent[i])
+                return false;
+        return true;
+    }
+
     template <typename T, size_t N>
+    typename GridView<T, N>::iterator GridView<T, N>::end() const noexcept {
+        index_type pos;
+        pos[0] = extent[0];
+        return {origin + extent[0] * stride[0], pos, extent, stride};
+    }
+
+    template <typename T, size_t N>
+    template <size_t M>
+    std::enable_if_t<(M > 1), GridView<T, M - 1>> GridView<T, N>::fix(size_t axis, ptrdiff_t pos) const {
+        if (pos < 0 || pos >= extent[axis])
+            throw std::out_of_range("Grid index out of range");
+        Vector<ptrdiff_t, N - 1> shape, strides;
+        for (size_t i = 0, j = 0; i < N; ++i) {
+            if (i != axis) {
+                shape[j] = extent[i];
+                strides[j] = stride[i];
+                ++j;
+            }
+        }
+        return {origin + pos * stride[axis], shape, strides};
+    }
+
+    template <typename T, size_t N>
+    GridView<T, N> GridView<T, N>::slice(const index_type& pos, const index_type& shape) const {
+        for (size_t i = 0; i < N; ++i)
+            if (pos[i] < 0 || shape[i] < 0 || pos[i] + shape[i] > extent[i])
+                throw std::out_of_range("Grid slice out of range");
+        return {origin + get_offset(pos), shape, stride};
+    }
+
+    template <typename T, size_t N>
+    GridView<T, N> GridView<T, N>::step(size_t axis, ptrdiff_t delta) const {
+        if (delta == 0)
+            throw std::invalid_argument("Grid step is zero");
+        GridView v = *this;
+        ptrdiff_t n = extent[axis];
+        if (delta < 0 && n > 0)
+            v.origin += (n - 1) * stride[axis];
+        v.extent[axis] = (n + std::abs(delta) - 1) / std::abs(delta);
+        v.stride[axis] *= delta;
+        return v;
+    }
+
+    template <typename T, size_t N>
+    GridView<T, N> GridView<T, N>::transpose(size_t axis1, size_t axis2) const noexcept {
+        GridView v = *this;
+        std::swap(v.extent[axis1], v.extent[axis2]);
+        std::swap(v.stride[axis1], v.stride[axis2]);
+        return v;
+    }
+
+    template <typename T, size_t N, GridLayout L = GridLayout::row_major>
     class Grid:
-    public EqualityComparable<Grid<T, N>> {
+    public EqualityComparable<Grid<T, N, L>> {
     private:
         template <bool IsConst>
         class basic_iterator:
@@ -23,18 +446,20 @@ namespace RS {
             using target_type = std::conditional_t<IsConst, const T, T>;
         public:
             basic_iterator() = default;
-            basic_iterator(const basic_iterator<false>& i): grid(i.grid), ofs(i.ofs) {}
+            basic_iterator(const basic_iterator<false>& i): grid(i.grid), ofs(i.ofs), where(i.where), outside(i.outside) {}
             target_type& operator*() const noexcept { return grid->data[ofs]; }
-            basic_iterator& operator++() { ++ofs; return *this; }
+            basic_iterator& operator++() { ofs = grid->next_offset(ofs + 1); return *this; }
             bool operator==(const basic_iterator& rhs) const noexcept { return ofs == rhs.ofs; }
-            void move(size_t axis, ptrdiff_t delta) noexcept { ofs += delta * grid->scale[axis]; }
+            void move(size_t axis, ptrdiff_t delta) noexcept;
             typename Grid::index_type pos() const { return grid->get_index(ofs); }
         private:
             friend class Grid;
             friend class basic_iterator<true>;
             grid_type* grid;
             ptrdiff_t ofs; // Index into grid->data
-            basic_iterator(grid_type& g, ptrdiff_t o): grid(&g), ofs(o) {}
+            typename Grid::index_type where; // Position while outside the grid (blocked layouts only)
+            bool outside = false;
+            basic_iterator(grid_type& g, ptrdiff_t o): grid(&g), ofs(o), where() {}
         };
     public:
         using const_iterator = basic_iterator<true>;
@@ -46,10 +471,14 @@ namespace RS {
         using size_type = size_t;
         using value_type = T;
         static constexpr size_t dim = N;
+        static constexpr GridLayout layout = L;
         Grid(): extent(), scale(), data() { zero_coords(); }
-        explicit Grid(const index_type& shape): extent(shape), scale(make_scale(extent)), data(size()) {}
-        Grid(const index_type& shape, const T& t): extent(shape), scale(make_scale(extent)), data(size(), t) {}
-        template <typename... Args> explicit Grid(Args... shape): extent{shape...}, scale(make_scale(extent)), data(size()) {}
+        explicit Grid(const index_type& shape):
+            extent(shape), bits(make_bits(extent)), scale(make_scale(extent, bits)), padded(storage_size() != size()), data(storage_size()) {}
+        Grid(const index_type& shape, const T& t):
+            extent(shape), bits(make_bits(extent)), scale(make_scale(extent, bits)), padded(storage_size() != size()), data(storage_size(), t) {}
+        template <typename... Args> explicit Grid(Args... shape):
+            extent{shape...}, bits(make_bits(extent)), scale(make_scale(extent, bits)), padded(storage_size() != size()), data(storage_size()) {}
         T& operator[](const index_type& pos) noexcept { return data[get_offset(pos)]; }
         const T& operator[](const index_type& pos) const noexcept { return data[get_offset(pos)]; }
         template <typename... Args> T& operator()(Args... pos) noexcept { return data[get_offset(index_type{pos...})]; }
@@ -58,103 +487,471 @@ namespace RS {
         const T& at(const index_type& pos) const { return data[get_offset_checked(pos)]; }
         template <typename... Args> T& at(Args... pos) { return data[get_offset_checked(index_type{pos...})]; }
         template <typename... Args> const T& at(Args... pos) const { return data[get_offset_checked(index_type{pos...})]; }
-        iterator begin() noexcept { return {*this, 0}; }
-        const_iterator begin() const noexcept { return {*this, 0}; }
+        iterator begin() noexcept { return {*this, next_offset(0)}; }
+        const_iterator begin() const noexcept { return {*this, next_offset(0)}; }
+        index_type block_shape() const noexcept;
         void clear() noexcept { zero_coords(); data.clear(); }
         bool contains(const index_type& pos) const noexcept;
         template <typename... Args> bool contains(Args... pos) const noexcept { return contains(index_type{pos...}); }
         bool empty() const noexcept { return data.empty(); }
-        iterator end() noexcept { return {*this, ptrdiff_t(size())}; }
-        const_iterator end() const noexcept { return {*this, ptrdiff_t(size())}; }
-        void fill(const T& t) { std::fill(begin(), end(), t); }
+        iterator end() noexcept { return {*this, ptrdiff_t(data.size())}; }
+        const_iterator end() const noexcept { return {*this, ptrdiff_t(data.size())}; }
+        void fill(const T& t) { std::fill(data.begin(), data.end(), t); }
+        void flush() { data.flush(); }
         iterator locate(const index_type& pos) noexcept { return {*this, get_offset(pos)}; }
         const_iterator locate(const index_type& pos) const noexcept { return {*this, get_offset(pos)}; }
         template <typename... Args> iterator locate(Args... pos) noexcept { return {*this, get_offset(index_type{pos...})}; }
         template <typename... Args> const_iterator locate(Args... pos) const noexcept { return {*this, get_offset(index_type{pos...})}; }
+        bool mapped() const noexcept { return data.mapped(); }
         void reset(const index_type& shape, const T& t = T()) { Grid g(shape, t); *this = std::move(g); }
         template <typename... Args> void reset(Args... shape) { Grid g(shape...); *this = std::move(g); }
         void reshape(const index_type& shape, const T& t = T());
         template <typename... Args> void reshape(Args... shape) { reshape(index_type{shape...}); }
         index_type shape() const noexcept { return extent; }
-        size_t size() const noexcept { return extent[0] * scale[0]; }
+        size_t size() const noexcept;
+        template <typename F> void for_each_index(F f, size_t threads = 0);
+        template <typename K> Grid convolve(const Grid<K, N, L>& kernel, size_t threads = 0) const;
+        template <typename U, typename F> U reduce(U init, F f, size_t threads = 0) const;
+        template <typename F> void transform(F f, size_t threads = 0);
+        template <typename U, typename F> void transform(const Grid<U, N, L>& src, F f, size_t threads = 0);
+        static Grid map(const File& f, uint32_t flags = 0);
+        static Grid map_new(const File& f, const index_type& shape, const T& t = T());
+        template <GridLayout L2 = L> std::enable_if_t<L2 == GridLayout::row_major, GridView<T, N>> view() noexcept
+            { return {data.data(), extent, scale}; }
+        template <GridLayout L2 = L> std::enable_if_t<L2 == GridLayout::row_major, ConstGridView<T, N>> view() const noexcept
+            { return {data.data(), extent, scale}; }
     private:
         static_assert(N > 0);
-        using data_type = std::vector<T>;
+        static constexpr bool blocked = L != GridLayout::row_major;
+        using data_type = RS_Detail::GridStorage<T>;
         index_type extent;
-        index_type scale;
-        data_type data;
+        int bits = 0; // Log2 of block side (blocked layouts only)
+        index_type scale; // Row-major scale over blocks (elements for row_major)
+        bool padded = false;
+        data_type data; // Blocked layouts may include padding around the edges
         index_type get_index(ptrdiff_t ofs) const noexcept;
-        constexpr ptrdiff_t get_offset(const index_type& pos) const noexcept { return std::inner_product(pos.begin(), pos.end(), scale.begin(), size_t(0)); }
+        ptrdiff_t get_offset(const index_type& pos) const noexcept;
+        template <size_t... I> ptrdiff_t get_block_offset(const index_type& pos, std::index_sequence<I...>) const noexcept;
         ptrdiff_t get_offset_checked(const index_type& pos) const;
+        ptrdiff_t next_offset(ptrdiff_t ofs) const noexcept;
+        void set_shape(const index_type& shape) noexcept;
+        size_t storage_size() const noexcept;
         void zero_coords() noexcept;
-        static index_type make_scale(const index_type& extent) noexcept;
-        static void reshape_copy(const Grid& src, Grid& dst, index_type index, ptrdiff_t current);
+        static uint64_t file_type_code() noexcept;
+        static int make_bits(const index_type& extent) noexcept;
+        static index_type make_scale(const index_type& extent, int bits) noexcept;
+        template <typename F> void run_slabs(size_t threads, F f) const;
+        static void reshape_move(Grid& src, Grid& dst, index_type index, ptrdiff_t current);
+        template <typename U, size_t M, GridLayout L2> friend class Grid;
     };
 
-    template <typename T, size_t N>
-    bool Grid<T, N>::contains(const index_type& pos) const noexcept {
+    template <typename T, size_t N, GridLayout L>
+    template <bool IsConst>
+    void Grid<T, N, L>::basic_iterator<IsConst>::move(size_t axis, ptrdiff_t delta) noexcept {
+        if constexpr (blocked) {
+            // Blocked offsets can't represent positions outside the grid,
+            // so remember the coordinates until we move back inside
+            if (! outside)
+                where = grid->get_index(ofs);
+            where[axis] += delta;
+            outside = ! grid->contains(where);
+            if (! outside)
+                ofs = grid->get_offset(where);
+        } else {
+            ofs += delta * grid->scale[axis];
+        }
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    typename Grid<T, N, L>::index_type Grid<T, N, L>::block_shape() const noexcept {
+        index_type shape;
+        std::fill(shape.begin(), shape.end(), ptrdiff_t(1) << bits);
+        return shape;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    size_t Grid<T, N, L>::size() const noexcept {
+        if constexpr (blocked)
+            return std::accumulate(extent.begin(), extent.end(), size_t(1), std::multiplies<size_t>());
+        else
+            return extent[0] * scale[0];
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    bool Grid<T, N, L>::contains(const index_type& pos) const noexcept {
         for (size_t i = 0; i < N; ++i)
             if (pos[i] < 0 || pos[i] >= extent[i])
                 return false;
         return true;
     }
 
-    template <typename T, size_t N>
-    void Grid<T, N>::reshape(const index_type& shape, const T& t) {
+    template <typename T, size_t N, GridLayout L>
+    template <typename F>
+    void Grid<T, N, L>::for_each_index(F f, size_t threads) {
+        static_assert(L == GridLayout::row_major, "Grid bulk operations require a row major grid");
+        run_slabs(threads, [&] (ptrdiff_t first, ptrdiff_t last) {
+            index_type pos;
+            if constexpr (N == 1) {
+                for (pos[0] = first; pos[0] < last; ++pos[0])
+                    f(static_cast<const index_type&>(pos), data[pos[0]]);
+            } else {
+                pos[0] = first;
+                ptrdiff_t n = extent[N - 1];
+                for (T* row = data.data() + first * scale[0], * end = data.data() + last * scale[0]; row != end; row += n) {
+                    for (ptrdiff_t j = 0; j < n; ++j) {
+                        pos[N - 1] = j;
+                        f(static_cast<const index_type&>(pos), row[j]);
+                    }
+                    for (size_t i = N - 1; i > 0 && ++pos[i - 1] == extent[i - 1] && i > 1; --i)
+                        pos[i - 1] = 0;
+                }
+            }
+        });
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    template <typename K>
+    Grid<T, N, L> Grid<T, N, L>::convolve(const Grid<K, N, L>& kernel, size_t threads) const {
+        // For each output row and each kernel element, accumulate one
+        // shifted source row with a constant weight; the inner loop is over
+        // contiguous elements so it can be vectorized
+        static_assert(L == GridLayout::row_major, "Grid bulk operations require a row major grid");
+        Grid result(extent);
+        if (empty() || kernel.empty())
+            return result;
+        index_type centre;
+        for (size_t i = 0; i < N; ++i)
+            centre[i] = kernel.extent[i] / 2;
+        std::vector<std::pair<index_type, K>> taps;
+        for (auto k = kernel.begin(); k != kernel.end(); ++k)
+            taps.push_back({k.pos() - centre, *k});
+        ptrdiff_t n = extent[N - 1];
+        ptrdiff_t rows_per_slab = N == 1 ? 1 : scale[0] / n;
+        result.run_slabs(N == 1 ? 1 : threads, [&] (ptrdiff_t first, ptrdiff_t last) {
+            index_type pos, src_pos;
+            pos[0] = first;
+            if constexpr (N == 1)
+                last = 1;
+            for (ptrdiff_t r = first * rows_per_slab, r_end = last * rows_per_slab; r < r_end; ++r) {
+                T* out = result.data.data() + r * n;
+                for (auto& tap: taps) {
+                    bool inside = true;
+                    for (size_t i = 0; i + 1 < N && inside; ++i) {
+                        src_pos[i] = pos[i] + tap.first[i];
+                        inside = src_pos[i] >= 0 && src_pos[i] < extent[i];
+                    }
+                    if (! inside)
+                        continue;
+                    ptrdiff_t shift = tap.first[N - 1];
+                    ptrdiff_t j0 = std::max(ptrdiff_t(0), - shift), j1 = std::min(n, n - shift);
+                    src_pos[N - 1] = 0;
+                    const T* in = data.data() + get_offset(src_pos);
+                    K w = tap.second;
+                    for (ptrdiff_t j = j0; j < j1; ++j)
+                        out[j] += w * in[j + shift];
+                }
+                for (size_t i = N - 1; i > 0 && ++pos[i - 1] == extent[i - 1] && i > 1; --i)
+                    pos[i - 1] = 0;
+            }
+        });
+        return result;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    template <typename U, typename F>
+    U Grid<T, N, L>::reduce(U init, F f, size_t threads) const {
+        static_assert(L == GridLayout::row_major, "Grid bulk operations require a row major grid");
+        // Partial results are combined in slab order, so the result does
+        // not depend on thread timing
+        std::vector<std::pair<ptrdiff_t, U>> partial;
+        Mutex mutex;
+        run_slabs(threads, [&] (ptrdiff_t first, ptrdiff_t last) {
+            const T* p = data.data() + first * scale[0];
+            const T* end = data.data() + last * scale[0];
+            if (p == end)
+                return;
+            U acc = *p;
+            for (++p; p != end; ++p)
+                acc = f(acc, *p);
+            MutexLock lock(mutex);
+            partial.push_back({first, acc});
+        });
+        std::sort(partial.begin(), partial.end(), [] (auto& a, auto& b) { return a.first < b.first; });
+        for (auto& u: partial)
+            init = f(init, u.second);
+        return init;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    template <typename F>
+    void Grid<T, N, L>::transform(F f, size_t threads) {
+        static_assert(L == GridLayout::row_major, "Grid bulk operations require a row major grid");
+        run_slabs(threads, [&] (ptrdiff_t first, ptrdiff_t last) {
+            for (T* p = data.data() + first * scale[0], * end = data.data() + last * scale[0]; p != end; ++p)
+                *p = f(*p);
+        });
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    template <typename U, typename F>
+    void Grid<T, N, L>::transform(const Grid<U, N, L>& src, F f, size_t threads) {
+        static_assert(L == GridLayout::row_major, "Grid bulk operations require a row major grid");
+        if (src.shape() != extent)
+            throw std::invalid_argument("Grid shapes do not match");
+        run_slabs(threads, [&] (ptrdiff_t first, ptrdiff_t last) {
+            const U* q = src.data.data() + first * scale[0];
+            for (T* p = data.data() + first * scale[0], * end = data.data() + last * scale[0]; p != end; ++p, ++q)
+                *p = f(*q);
+        });
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    Grid<T, N, L> Grid<T, N, L>::map(const File& f, uint32_t flags) {
+        using namespace RS_Detail;
+        static_assert(std::is_trivially_copyable<T>::value, "Mapped grid elements must be trivially copyable");
+        Blob b = grid_map_file(f, 0, flags);
+        GridFileHeader header;
+        if (b.size() < grid_file_header_size)
+            throw std::runtime_error("Not a grid file: " + f.name());
+        std::memcpy(&header, b.data(), sizeof(header));
+        if (std::memcmp(header.magic, grid_file_magic, sizeof(header.magic)) != 0 || header.version != grid_file_version)
+            throw std::runtime_error("Not a grid file: " + f.name());
+        if (header.dims != N || header.layout != uint32_t(L) || header.element_size != sizeof(T) || header.element_type != file_type_code())
+            throw std::runtime_error("Grid file does not match grid type: " + f.name());
+        index_type shape;
+        for (size_t i = 0; i < N; ++i) {
+            int64_t x;
+            std::memcpy(&x, b.bdata() + sizeof(header) + i * sizeof(x), sizeof(x));
+            if (x < 0)
+                throw std::runtime_error("Not a grid file: " + f.name());
+            shape[i] = ptrdiff_t(x);
+        }
+        Grid g;
+        g.set_shape(shape);
+        size_t n = g.storage_size();
+        if (b.size() - grid_file_header_size != n * sizeof(T))
+            throw std::runtime_error("Grid file has the wrong size: " + f.name());
+        g.data = data_type(std::move(b), grid_file_header_size, n);
+        return g;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    Grid<T, N, L> Grid<T, N, L>::map_new(const File& f, const index_type& shape, const T& t) {
+        using namespace RS_Detail;
+        static_assert(std::is_trivially_copyable<T>::value, "Mapped grid elements must be trivially copyable");
+        static_assert(sizeof(GridFileHeader) + N * sizeof(int64_t) <= grid_file_header_size, "Too many dimensions for a grid file");
+        Grid g;
+        g.set_shape(shape);
+        size_t n = g.storage_size();
+        Blob b = grid_map_file(f, grid_file_header_size + n * sizeof(T), 0);
+        GridFileHeader header;
+        std::memcpy(header.magic, grid_file_magic, sizeof(header.magic));
+        header.version = grid_file_version;
+        header.dims = uint32_t(N);
+        header.layout = uint32_t(L);
+        header.element_size = uint32_t(sizeof(T));
+        header.element_type = file_type_code();
+        std::memcpy(b.data(), &header, sizeof(header));
+        for (size_t i = 0; i < N; ++i) {
+            auto x = int64_t(shape[i]);
+            std::memcpy(b.bdata() + sizeof(header) + i * sizeof(x), &x, sizeof(x));
+        }
+        g.data = data_type(std::move(b), grid_file_header_size, n);
+        // A new file reads as zeros, so an all-zero fill value needs no
+        // writes and the file can stay sparse
+        auto tp = reinterpret_cast<const unsigned char*>(&t);
+        if (! std::all_of(tp, tp + sizeof(T), [] (unsigned char c) { return c == 0; }))
+            g.fill(t);
+        return g;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    void Grid<T, N, L>::reshape(const index_type& shape, const T& t) {
+        // If only the first dimension changes, a row-major grid can be
+        // resized in place
+        if (! blocked && ! empty() && std::equal(shape.begin() + 1, shape.end(), extent.begin() + 1)) {
+            extent[0] = shape[0];
+            data.resize(storage_size(), t);
+            return;
+        }
         Grid g(shape, t);
-        reshape_copy(*this, g, index_type(), 0);
+        reshape_move(*this, g, index_type(), 0);
         *this = std::move(g);
     }
 
-    template <typename T, size_t N>
-    typename Grid<T, N>::index_type Grid<T, N>::get_index(ptrdiff_t ofs) const noexcept {
-        auto x = ofs;
+    template <typename T, size_t N, GridLayout L>
+    typename Grid<T, N, L>::index_type Grid<T, N, L>::get_index(ptrdiff_t ofs) const noexcept {
+        auto x = ofs >> (bits * N);
         index_type pos;
         for (size_t i = 0; i < N; ++i) {
             pos[i] = x / scale[i];
             x %= scale[i];
         }
+        if constexpr (blocked) {
+            uint64_t inner = uint64_t(ofs) & ((uint64_t(1) << (bits * N)) - 1);
+            uint64_t mask = (uint64_t(1) << bits) - 1;
+            for (size_t i = 0; i < N; ++i) {
+                uint64_t p;
+                if constexpr (L == GridLayout::tiled)
+                    p = (inner >> (bits * (N - 1 - i))) & mask;
+                else
+                    p = RS_Detail::grid_morton_compact<N>(inner >> (N - 1 - i));
+                pos[i] = (pos[i] << bits) + ptrdiff_t(p);
+            }
+        }
         return pos;
     }
 
-    template <typename T, size_t N>
-    ptrdiff_t Grid<T, N>::get_offset_checked(const index_type& pos) const {
+    template <typename T, size_t N, GridLayout L>
+    ptrdiff_t Grid<T, N, L>::get_offset(const index_type& pos) const noexcept {
+        if constexpr (blocked)
+            return get_block_offset(pos, std::make_index_sequence<N>());
+        else
+            return std::inner_product(pos.begin(), pos.end(), scale.begin(), ptrdiff_t(0));
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    template <size_t... I>
+    ptrdiff_t Grid<T, N, L>::get_block_offset(const index_type& pos, std::index_sequence<I...>) const noexcept {
+        // Unrolled by hand because this is on the critical path of every
+        // element access, and GCC won't unroll the loop at -O2
+        uint64_t mask = (uint64_t(1) << bits) - 1;
+        uint64_t outer = (uint64_t(0) + ... + (uint64_t(pos[I] >> bits) * uint64_t(scale[I])));
+        uint64_t inner;
+        if constexpr (L == GridLayout::tiled)
+            inner = (uint64_t(0) | ... | ((uint64_t(pos[I]) & mask) << (bits * (N - 1 - I))));
+        else
+            inner = (uint64_t(0) | ... | (RS_Detail::grid_morton_spread<N>(uint64_t(pos[I]) & mask) << (N - 1 - I)));
+        return ptrdiff_t((outer << (bits * N)) + inner);
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    ptrdiff_t Grid<T, N, L>::get_offset_checked(const index_type& pos) const {
         for (size_t i = 0; i < N; ++i)
             if (pos[i] < 0 || pos[i] >= extent[i])
                 throw std::out_of_range("Grid index out of range");
         return get_offset(pos);
     }
 
-    template <typename T, size_t N>
-    void Grid<T, N>::zero_coords() noexcept {
+    template <typename T, size_t N, GridLayout L>
+    ptrdiff_t Grid<T, N, L>::next_offset(ptrdiff_t ofs) const noexcept {
+        // Skip padding slots in the edge blocks
+        if constexpr (blocked) {
+            if (padded) {
+                auto n = ptrdiff_t(data.size());
+                while (ofs < n && ! contains(get_index(ofs)))
+                    ++ofs;
+            }
+        }
+        return ofs;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    void Grid<T, N, L>::set_shape(const index_type& shape) noexcept {
+        extent = shape;
+        bits = make_bits(extent);
+        scale = make_scale(extent, bits);
+        padded = storage_size() != size();
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    size_t Grid<T, N, L>::storage_size() const noexcept {
+        ptrdiff_t side = ptrdiff_t(1) << bits;
+        return size_t((extent[0] + side - 1) >> bits) * scale[0] << (bits * N);
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    void Grid<T, N, L>::zero_coords() noexcept {
         std::fill(extent.begin(), extent.end(), 0);
         std::fill(scale.begin(), scale.end(), 0);
+        bits = 0;
+        padded = false;
     }
 
-    template <typename T, size_t N>
-    typename Grid<T, N>::index_type Grid<T, N>::make_scale(const index_type& extent) noexcept {
+    template <typename T, size_t N, GridLayout L>
+    uint64_t Grid<T, N, L>::file_type_code() noexcept {
+        // Only meaningful between programs built with the same compiler
+        const char* name = typeid(T).name();
+        return wyhash(name, std::strlen(name));
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    int Grid<T, N, L>::make_bits(const index_type& extent) noexcept {
+        // Tiles are sized to fit about 4k bytes; Morton blocks are as large
+        // as the shortest side allows. Neither is larger than needed to
+        // cover the shortest side.
+        int max_bits = 0;
+        if constexpr (L == GridLayout::tiled) {
+            size_t elements = std::max(size_t(4096) / sizeof(T), size_t(1));
+            while ((size_t(2) << max_bits) <= elements)
+                ++max_bits;
+            max_bits /= int(N);
+        } else if constexpr (L == GridLayout::morton) {
+            max_bits = int(63 / N);
+        }
+        ptrdiff_t min_extent = *std::min_element(extent.begin(), extent.end());
+        int bits = 0;
+        while (bits < max_bits && (ptrdiff_t(1) << bits) < min_extent)
+            ++bits;
+        return bits;
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    typename Grid<T, N, L>::index_type Grid<T, N, L>::make_scale(const index_type& extent, int bits) noexcept {
+        ptrdiff_t side = ptrdiff_t(1) << bits;
         index_type scale;
         scale[N - 1] = 1;
         for (size_t i = N - 1; i > 0; --i)
-            scale[i - 1] = scale[i] * extent[i];
+            scale[i - 1] = scale[i] * ((extent[i] + side - 1) >> bits);
         return scale;
     }
 
-    template <typename T, size_t N>
-    void Grid<T, N>::reshape_copy(const Grid& src, Grid& dst, index_type index, ptrdiff_t current) {
+    template <typename T, size_t N, GridLayout L>
+    template <typename F>
+    void Grid<T, N, L>::run_slabs(size_t threads, F f) const {
+        // Split the grid into slabs along the first axis, one per thread,
+        // and call f(first,last) for each range of first coordinates; the
+        // last slab runs in the calling thread
+        static const size_t cpus = Thread::cpu_threads();
+        static constexpr size_t min_per_thread = 16384;
+        if (threads == 0)
+            threads = std::min(cpus, size() / min_per_thread);
+        ptrdiff_t rows = extent[0];
+        auto slabs = ptrdiff_t(std::min(std::max(threads, size_t(1)), size_t(std::max(rows, ptrdiff_t(1)))));
+        if (slabs <= 1) {
+            f(ptrdiff_t(0), rows);
+            return;
+        }
+        std::vector<Thread> workers;
+        workers.reserve(slabs - 1);
+        for (ptrdiff_t i = 0; i < slabs - 1; ++i) {
+            ptrdiff_t first = rows * i / slabs, last = rows * (i + 1) / slabs;
+            workers.emplace_back([&f, first, last] { f(first, last); });
+        }
+        f(rows * (slabs - 1) / slabs, rows);
+        for (auto& w: workers)
+            w.wait();
+    }
+
+    template <typename T, size_t N, GridLayout L>
+    void Grid<T, N, L>::reshape_move(Grid& src, Grid& dst, index_type index, ptrdiff_t current) {
         ptrdiff_t n_common = std::min(src.shape()[current], dst.shape()[current]);
         ptrdiff_t& iref = index[current];
-        if (current == N - 1) {
+        if (current == N - 1 && ! blocked) {
             iref = 0;
-            std::copy_n(&src[index], n_common, &dst[index]);
+            if (n_common > 0)
+                std::move(&src[index], &src[index] + n_common, &dst[index]);
+        } else if (current == N - 1) {
+            for (iref = 0; iref < n_common; ++iref)
+                dst[index] = std::move(src[index]);
         } else {
             for (iref = 0; iref < n_common; ++iref)
-                reshape_copy(src, dst, index, current + 1);
+                reshape_move(src, dst, index, current + 1);
         }
     }
 
-    template <typename T, size_t N>
-    bool operator==(const Grid<T, N>& lhs, const Grid<T, N>& rhs) noexcept {
+    template <typename T, size_t N, GridLayout L>
+    bool operator==(const Grid<T, N, L>& lhs, const Grid<T, N, L>& rhs) noexcept {
         return lhs.shape() == rhs.shape() && std::equal(lhs.begin(), lhs.end(), rhs.begin());
     }
 
@@ -1,10 +1,13 @@
 #include "rs-core/index-table.hpp"
 #include "rs-core/string.hpp"
 #include "rs-core/unit-test.hpp"
+#include <algorithm>
 #include <iterator>
 #include <memory>
 #include <ostream>
+#include <stdexcept>
 #include <string>
+#include <vector>
 
 using namespace RS;
 
@@ -25,6 +28,33 @@ namespace {
 
     std::ostream& operator<<(std::ostream& out, const Neddie& x) { return out << x.num() << ":" << x.str(); }
 
+    class Fragile {
+    public:
+        static int instances;
+        static bool fail;
+        explicit Fragile(int n = 0): num(n) { ++instances; }
+        Fragile(const Fragile& f): num(f.num) { if (fail) throw std::runtime_error("Fragile"); ++instances; }
+        ~Fragile() noexcept { --instances; }
+        Fragile& operator=(const Fragile&) = default;
+        int num;
+    };
+
+    int Fragile::instances = 0;
+    bool Fragile::fail = false;
+
+    struct GetNum {
+        int operator()(const Neddie& x) const { return x.num(); }
+    };
+
+    struct GetStr {
+        std::string operator()(const Neddie& x) const { return x.str(); }
+    };
+
+    struct Order {
+        bool reverse = false;
+        bool operator()(int a, int b) const { return reverse ? b < a : a < b; }
+    };
+
     void check_index_table() {
 
         using table_type = IndexTable<Neddie>;
@@ -236,13 +266,397 @@ namespace {
         TRY(int_index(t2, &Neddie::num));
         TEST_THROW(string_index(t2, &Neddie::str), IndexCollision);
 
+        TRY(t1.clear());
+        TRY(t1.insert(Neddie(1, "alpha")));
+        TRY(t1.insert(Neddie(1, "bravo")));
+        TRY(t1.insert(Neddie(1, "charlie")));
+        TRY(x1 = std::next(t1.begin()));
+        TRY(t1.erase(x1));
+        TEST_EQUAL(cii.count(1), 2);
+        TEST_EQUAL(to_str(cii), "[1:alpha,1:charlie]");
+        TRY(ii.erase(1));
+        TEST(t1.empty());
+        TEST(cii.empty());
+        TEST(csi.empty());
+
+    }
+
+    void check_index_table_storage() {
+
+        using table_type = IndexTable<int>;
+        using int_index = Index<int, int>;
+
+        table_type t;
+        int_index ii(t);
+        std::vector<int*> ptrs;
+        std::vector<int> v;
+        table_type::iterator x;
+        table_type::const_iterator cx;
+        const table_type& ct(t);
+
+        for (int i = 0; i < 10000; ++i) {
+            TRY(t.insert(i));
+            ptrs.push_back(&*std::prev(t.end()));
+        }
+        TEST_EQUAL(t.size(), 10000);
+        int errors = 0;
+        for (int i = 0; i < 10000; ++i)
+            errors += int(*ptrs[i] != i);
+        TEST_EQUAL(errors, 0);
+
+        for (int i = 0; i < 10000; i += 2)
+            TRY(ii.erase(i));
+        TEST_EQUAL(t.size(), 5000);
+        TEST_EQUAL(ii.size(), 5000);
+        TRY(t.insert(-1));
+        TRY(t.insert(-2));
+        TEST_EQUAL(*std::prev(t.end()), -2);
+        TEST_EQUAL(*std::prev(t.end(), 2), -1);
+        TEST_EQUAL(*std::prev(t.end(), 3), 9999);
+        TEST_EQUAL(*t.begin(), 1);
+        TEST_EQUAL(*std::next(t.begin()), 3);
+        TEST_EQUAL(*ii.begin(), -2);
+        TEST_EQUAL(*std::prev(ii.end()), 9999);
+        TEST_EQUAL(*ptrs[9999], 9999);
+
+        TRY(x = t.begin());
+        TRY(cx = x);
+        TEST(cx == ct.begin());
+        TEST_EQUAL(std::distance(ct.begin(), ct.end()), 5002);
+        TRY(v.assign(ct.begin(), ct.end()));
+        TEST_EQUAL(v.size(), 5002);
+        TEST_EQUAL(v[0], 1);
+        TEST_EQUAL(v[4999], 9999);
+        TEST_EQUAL(v[5000], -1);
+        TEST_EQUAL(v[5001], -2);
+
+        TRY(t.erase(t.begin(), std::prev(t.end(), 2)));
+        TEST_EQUAL(to_str(t), "[-1,-2]");
+        TEST_EQUAL(to_str(ii), "[-2,-1]");
+        TRY(t.clear());
+        TEST(t.empty());
+        TEST(t.begin() == t.end());
+        TRY(t.reserve(100));
+        TRY(t.insert(std::vector<int>{3, 1, 2}));
+        TEST_EQUAL(to_str(t), "[3,1,2]");
+        TEST_EQUAL(to_str(ii), "[1,2,3]");
+
+        {
+            IndexTable<Fragile> tf;
+            Index<int, Fragile> fi(tf, [] (const Fragile& f) { return f.num; });
+            Fragile f1(1), f2(2), f3(3);
+            TRY(tf.insert(f1));
+            TRY(tf.insert(f2));
+            TEST_EQUAL(Fragile::instances, 5);
+            Fragile::fail = true;
+            TEST_THROW(tf.insert(f3), std::runtime_error);
+            Fragile::fail = false;
+            TEST_EQUAL(tf.size(), 2);
+            TEST_EQUAL(fi.size(), 2);
+            TEST_EQUAL(Fragile::instances, 5);
+            TEST_THROW(tf.insert(f1), IndexCollision);
+            TEST_EQUAL(tf.size(), 2);
+            TEST_EQUAL(Fragile::instances, 5);
+            TRY(tf.insert(f3));
+            TEST_EQUAL(tf.size(), 3);
+            TEST_EQUAL(std::prev(tf.end())->num, 3);
+        }
+        TEST_EQUAL(Fragile::instances, 0);
+
+        // An index may outlive its table
+
+        auto tp = std::make_unique<table_type>();
+        int_index i2(*tp);
+        TRY(tp->insert(42));
+        TEST_EQUAL(i2.size(), 1);
+        TRY(tp.reset());
+        TEST(i2.empty());
+
     }
 
+    template <typename Index>
+    std::string sorted_str(const Index& index) {
+        std::vector<std::string> vec;
+        for (auto& x: index)
+            vec.push_back(to_str(x));
+        std::sort(vec.begin(), vec.end());
+        return to_str(vec);
+    }
+
+    void check_hash_index() {
+
+        using table_type = IndexTable<Neddie>;
+        using int_index = Index<int, Neddie, IndexMode::hash_duplicate>;
+        using string_index = Index<std::string, Neddie, IndexMode::hash_unique>;
+        using ordered_index = Index<std::string, Neddie>;
+
+        table_type t;
+        int hashes = 0;
+        auto my_hash = [&hashes] (const std::string& s) { ++hashes; return std::hash<std::string>()(s); };
+        int_index ii(t, &Neddie::num);
+        string_index si(t, &Neddie::str, my_hash);
+        ordered_index oi(t, &Neddie::str);
+        const int_index& cii(ii);
+        const string_index& csi(si);
+        int_index::iterator y;
+        string_index::iterator z;
+        string_index::const_iterator cz;
+
+        TEST(ii.empty());
+        TEST(si.empty());
+        TEST_EQUAL(ii.hash()(42), std::hash<int>()(42));
+        TEST_EQUAL(si.hash()("hello"), std::hash<std::string>()("hello"));
+        TEST(hashes > 0);
+
+        TRY(t.insert(Neddie(1, "alpha")));
+        TRY(t.insert(Neddie(2, "bravo")));
+        TRY(t.insert(Neddie(2, "charlie")));
+        TRY(t.insert(Neddie(3, "delta")));
+        TEST_EQUAL(t.size(), 4);
+        TEST_EQUAL(cii.size(), 4);
+        TEST_EQUAL(csi.size(), 4);
+        TEST_EQUAL(sorted_str(cii), "[1:alpha,2:bravo,2:charlie,3:delta]");
+        TEST_EQUAL(sorted_str(csi), "[1:alpha,2:bravo,2:charlie,3:delta]");
+
+        TEST_EQUAL(cii.count(1), 1);
+        TEST_EQUAL(cii.count(2), 2);
+        TEST_EQUAL(cii.count(4), 0);
+        TEST_EQUAL(csi.count("alpha"), 1);
+        TEST_EQUAL(csi.count("zulu"), 0);
+        TEST_EQUAL(std::distance(ii.equal_range(2).first, ii.equal_range(2).second), 2);
+        TEST_EQUAL(std::distance(si.equal_range("bravo").first, si.equal_range("bravo").second), 1);
+        TEST_EQUAL(std::distance(si.equal_range("zulu").first, si.equal_range("zulu").second), 0);
+
+        hashes = 0;
+        TRY(z = si.find("charlie"));
+        REQUIRE(z != si.end());
+        TEST_EQUAL(*z, Neddie(2, "charlie"));
+        TEST_EQUAL(z.key(), "charlie");
+        TEST_EQUAL(hashes, 1);
+        TRY(cz = csi.find("zulu"));
+        TEST(cz == csi.end());
+        TRY(y = ii.equal_range(3).first);
+        REQUIRE(y != ii.end());
+        TEST_EQUAL(*y, Neddie(3, "delta"));
+
+        // A collision in one index leaves the table and all indexes unchanged
+
+        TEST_THROW(t.insert(Neddie(4, "alpha")), IndexCollision);
+        TEST_EQUAL(t.size(), 4);
+        TEST_EQUAL(cii.size(), 4);
+        TEST_EQUAL(csi.size(), 4);
+        TEST_EQUAL(oi.size(), 4);
+        TEST_EQUAL(cii.count(4), 0);
+        TEST_EQUAL(to_str(t), "[1:alpha,2:bravo,2:charlie,3:delta]");
+        TEST_EQUAL(to_str(oi), "[1:alpha,2:bravo,2:charlie,3:delta]");
+
+        TRY(t.erase(std::next(t.begin())));
+        TEST_EQUAL(cii.count(2), 1);
+        TEST_EQUAL(csi.count("bravo"), 0);
+        TEST_EQUAL(sorted_str(cii), "[1:alpha,2:charlie,3:delta]");
+        TEST_EQUAL(sorted_str(csi), "[1:alpha,2:charlie,3:delta]");
+
+        TRY(si.erase(si.find("alpha")));
+        TEST_EQUAL(to_str(t), "[2:charlie,3:delta]");
+        TEST_EQUAL(sorted_str(cii), "[2:charlie,3:delta]");
+
+        TRY(t.insert(Neddie(3, "echo")));
+        TRY(t.insert(Neddie(3, "foxtrot")));
+        TRY(ii.erase(3));
+        TEST_EQUAL(to_str(t), "[2:charlie]");
+        TEST_EQUAL(sorted_str(csi), "[2:charlie]");
+        TEST_EQUAL(to_str(oi), "[2:charlie]");
+
+        for (int i = 0; i < 1000; ++i)
+            TRY(t.insert(Neddie(i % 10, "x" + std::to_string(i))));
+        TEST_EQUAL(t.size(), 1001);
+        TEST_EQUAL(cii.size(), 1001);
+        TEST_EQUAL(csi.size(), 1001);
+        TEST_EQUAL(cii.count(2), 101);
+        TEST_EQUAL(cii.count(5), 100);
+        TRY(ii.erase(5));
+        TEST_EQUAL(t.size(), 901);
+        TEST_EQUAL(csi.size(), 901);
+        TEST_EQUAL(csi.count("x5"), 0);
+        TEST_EQUAL(csi.count("x6"), 1);
+
+        TRY(t.clear());
+        TEST(ii.empty());
+        TEST(si.empty());
+
+        table_type t2;
+        TRY(t2.insert(Neddie(1, "zulu")));
+        TRY(t2.insert(Neddie(1, "zulu")));
+        TRY(int_index(t2, &Neddie::num));
+        TEST_THROW(string_index(t2, &Neddie::str), IndexCollision);
+
+    }
+
+
+    void check_index_static_functions() {
+
+        using table_type = IndexTable<Neddie>;
+        using int_index = Index<int, Neddie, IndexMode::unique, GetNum, Order>;
+        using dup_index = Index<int, Neddie, IndexMode::duplicate, GetNum, std::less<int>>;
+        using string_index = Index<std::string, Neddie, IndexMode::hash_unique, GetStr, std::hash<std::string>>;
+        using int_hash_index = Index<int, Neddie, IndexMode::hash_duplicate, GetNum, std::hash<int>>;
+
+        table_type t;
+        TRY(t.insert(Neddie(3, "charlie")));
+        TRY(t.insert(Neddie(1, "alpha")));
+
+        int_index ii(t);
+        int_index rii(t, GetNum(), Order{true});
+        dup_index di(t);
+        string_index si(t);
+        int_hash_index hi(t, GetNum(), std::hash<int>());
+        int_index::iterator y;
+
+        TRY(t.insert(Neddie(2, "bravo")));
+        TEST_THROW(t.insert(Neddie(1, "delta")), IndexCollision);
+        TEST_EQUAL(t.size(), 3);
+        TEST_EQUAL(to_str(ii), "[1:alpha,2:bravo,3:charlie]");
+        TEST_EQUAL(to_str(rii), "[3:charlie,2:bravo,1:alpha]");
+        TEST_EQUAL(to_str(di), "[1:alpha,2:bravo,3:charlie]");
+        TEST_EQUAL(sorted_str(si), "[1:alpha,2:bravo,3:charlie]");
+        TEST_EQUAL(sorted_str(hi), "[1:alpha,2:bravo,3:charlie]");
+        TEST(! ii.compare().reverse);
+        TEST(rii.compare().reverse);
+        TEST_EQUAL(ii.extract()(Neddie(42, "zulu")), 42);
+        TEST_EQUAL(si.hash()("hello"), std::hash<std::string>()("hello"));
+
+        TRY(y = ii.find(2));
+        REQUIRE(y != ii.end());
+        TEST_EQUAL(*y, Neddie(2, "bravo"));
+        TRY(y = ii.lower_bound(2));
+        TEST_EQUAL(std::distance(ii.begin(), y), 1);
+        TEST_EQUAL(si.count("charlie"), 1);
+        TEST_EQUAL(hi.count(3), 1);
+
+        TRY(si.erase("bravo"));
+        TEST_EQUAL(to_str(t), "[3:charlie,1:alpha]");
+        TEST_EQUAL(to_str(ii), "[1:alpha,3:charlie]");
+        TEST_EQUAL(to_str(rii), "[3:charlie,1:alpha]");
+        TEST_EQUAL(to_str(di), "[1:alpha,3:charlie]");
+        TEST_EQUAL(hi.count(2), 0);
+
+        // Mixing with the type erased form
+
+        Index<int, Neddie> fi(t, &Neddie::num);
+        TEST_EQUAL(to_str(fi), "[1:alpha,3:charlie]");
+        TRY(t.insert(Neddie(4, "echo")));
+        TEST_EQUAL(to_str(fi), "[1:alpha,3:charlie,4:echo]");
+        TEST_EQUAL(to_str(rii), "[4:echo,3:charlie,1:alpha]");
+
+    }
+
+    void check_index_bulk_load() {
+
+        using table_type = IndexTable<Neddie>;
+        using int_index = Index<int, Neddie, IndexMode::duplicate>;
+        using string_index = Index<std::string, Neddie>;
+        using hash_index = Index<std::string, Neddie, IndexMode::hash_unique>;
+        using int_hash_index = Index<int, Neddie, IndexMode::hash_duplicate>;
+
+        table_type t;
+        int_index ii(t, &Neddie::num);
+        string_index si(t, &Neddie::str);
+        hash_index hi(t, &Neddie::str);
+        int_hash_index ihi(t, &Neddie::num);
+        std::vector<Neddie> rows;
+
+        TRY(t.insert(Neddie(5, "x5")));
+        TRY(t.insert(Neddie(2, "x2")));
+        TRY(t.bulk_load(rows));
+        TEST_EQUAL(t.size(), 2);
+
+        rows = {{3, "c"}, {1, "a"}, {2, "b"}, {3, "d"}, {1, "e"}};
+        TRY(t.bulk_load(rows));
+        TEST_EQUAL(t.size(), 7);
+        TEST_EQUAL(ii.size(), 7);
+        TEST_EQUAL(si.size(), 7);
+        TEST_EQUAL(hi.size(), 7);
+        TEST_EQUAL(ihi.size(), 7);
+        TEST_EQUAL(to_str(t), "[5:x5,2:x2,3:c,1:a,2:b,3:d,1:e]");
+        TEST_EQUAL(to_str(ii), "[1:a,1:e,2:x2,2:b,3:c,3:d,5:x5]");
+        TEST_EQUAL(to_str(si), "[1:a,2:b,3:c,3:d,1:e,2:x2,5:x5]");
+        TEST_EQUAL(sorted_str(hi), "[1:a,1:e,2:b,2:x2,3:c,3:d,5:x5]");
+        TEST_EQUAL(ihi.count(3), 2);
+        TEST(hi.find("d") != hi.end());
+
+        // Collisions within the batch and against existing rows are all
+        // reported, and nothing is changed
+
+        rows = {{10, "f"}, {11, "a"}, {12, "g"}, {13, "g"}, {14, "x5"}};
+        try {
+            t.bulk_load(rows, 2);
+            FAIL("No exception");
+        }
+        catch (const IndexCollision& ex) {
+            TEST_EQUAL(ex.count(), 6);
+        }
+        TEST_EQUAL(t.size(), 7);
+        TEST_EQUAL(to_str(t), "[5:x5,2:x2,3:c,1:a,2:b,3:d,1:e]");
+        TEST_EQUAL(to_str(ii), "[1:a,1:e,2:x2,2:b,3:c,3:d,5:x5]");
+        TEST_EQUAL(to_str(si), "[1:a,2:b,3:c,3:d,1:e,2:x2,5:x5]");
+        TEST_EQUAL(sorted_str(hi), "[1:a,1:e,2:b,2:x2,3:c,3:d,5:x5]");
+        TEST_EQUAL(ihi.size(), 7);
+        TEST_EQUAL(ihi.count(10), 0);
+
+        rows.clear();
+        for (int i = 0; i < 10000; ++i)
+            rows.push_back(Neddie(i % 100, "y" + std::to_string(i)));
+        TRY(t.bulk_load(rows.begin(), rows.end(), 0));
+        TEST_EQUAL(t.size(), 10007);
+        TEST_EQUAL(ii.size(), 10007);
+        TEST_EQUAL(si.size(), 10007);
+        TEST_EQUAL(hi.size(), 10007);
+        TEST_EQUAL(ihi.size(), 10007);
+        TEST_EQUAL(ii.count(42), 100);
+        TEST_EQUAL(ihi.count(3), 102);
+        TEST_EQUAL(si.count("y9999"), 1);
+        TEST_EQUAL(*std::next(ii.equal_range(3).first, 2), Neddie(3, "y3"));
+        TEST_EQUAL(*std::prev(t.end()), Neddie(99, "y9999"));
+
+        // Indexes built over an existing table report all collisions
+
+        try {
+            Index<int, Neddie> bad(t, &Neddie::num);
+            FAIL("No exception");
+        }
+        catch (const IndexCollision& ex) {
+            TEST_EQUAL(ex.count(), 9907);
+        }
+
+        {
+            IndexTable<Fragile> tf;
+            Index<int, Fragile> fi(tf, [] (const Fragile& f) { return f.num; });
+            std::vector<Fragile> frs(3);
+            frs[1].num = 1;
+            frs[2].num = 2;
+            int before = Fragile::instances;
+            Fragile::fail = true;
+            TEST_THROW(tf.bulk_load(frs), std::runtime_error);
+            Fragile::fail = false;
+            TEST(tf.empty());
+            TEST(fi.empty());
+            TEST_EQUAL(Fragile::instances, before);
+            TRY(tf.bulk_load(frs));
+            TEST_EQUAL(tf.size(), 3);
+            TEST_EQUAL(fi.size(), 3);
+        }
+        TEST_EQUAL(Fragile::instances, 0);
+
+    }
 
 }
 
 TEST_MODULE(core, index_table) {
 
     check_index_table();
+    check_index_table_storage();
+    check_hash_index();
+    check_index_static_functions();
+    check_index_bulk_load();
 
 }
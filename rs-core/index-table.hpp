@@ -1,83 +1,288 @@
 #pragma once
 
 #include "rs-core/common.hpp"
+#include "rs-core/flat-map.hpp"
+#include "rs-core/thread.hpp"
+#include <algorithm>
 #include <functional>
 #include <iterator>
-#include <list>
 #include <map>
 #include <memory>
+#include <new>
 #include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <unordered_map>
+#include <utility>
+#include <vector>
 
 namespace RS {
 
-    RS_ENUM_CLASS(IndexMode, int, 1, unique, duplicate);
+    RS_ENUM_CLASS(IndexMode, int, 1, unique, duplicate, hash_unique, hash_duplicate);
 
     template <typename T> class IndexTable;
-    template <typename K, typename T, IndexMode M = IndexMode::unique> class Index;
+    template <typename K, typename T, IndexMode M = IndexMode::unique, typename Extract = std::function<K(const T&)>,
+        typename Compare = std::conditional_t<M == IndexMode::hash_unique || M == IndexMode::hash_duplicate,
+            std::function<size_t(const K&)>, std::function<bool(const K&, const K&)>>>
+        class Index;
 
     class IndexCollision:
     public std::runtime_error {
     public:
-        IndexCollision(): std::runtime_error("Index collision") {}
+        IndexCollision(): std::runtime_error("Index collision"), num(1) {}
+        explicit IndexCollision(size_t n): std::runtime_error("Index collision: " + std::to_string(n) + " duplicate keys"), num(n) {}
+        size_t count() const noexcept { return num; }
+    private:
+        size_t num;
     };
 
     namespace RS_Detail {
 
-        template <typename K, typename T, IndexMode M> struct IndexMapTraits;
-
-        template <typename K, typename T>
-        struct IndexMapTraits<K, T, IndexMode::unique> {
-            using compare_function = std::function<bool(const K&, const K&)>;
-            using map_type = std::map<K, T, compare_function>;
+        template <typename K, typename T, typename Map, bool Unique>
+        struct IndexMapOps {
+            using map_type = Map;
             using value_type = typename map_type::value_type;
+            static size_t count(const map_type& map, const K& k) { return map.count(k); }
+            template <typename M2> static auto equal_range(M2& map, const K& k) { return map.equal_range(k); }
+            static void erase(const K& k, const T& value, map_type& map) {
+                // Only remove the entry for this element, not others with the same key
+                auto range = map.equal_range(k);
+                for (auto i = range.first; i != range.second; ++i) {
+                    if (i->second == value) {
+                        map.erase(i);
+                        break;
+                    }
+                }
+            }
             static void insert(const K& k, const T& value, map_type& map) {
-                if (! map.insert(value_type(k, value)).second)
+                if (! try_insert(k, value, map))
                     throw IndexCollision();
             }
+            static bool try_insert(const K& k, const T& value, map_type& map) {
+                if constexpr (Unique) {
+                    return map.insert(value_type(k, value)).second;
+                } else {
+                    map.insert(value_type(k, value));
+                    return true;
+                }
+            }
         };
 
+        // A std::function has no useful default state, so it gets the
+        // standard function object instead; any other type is default
+        // constructed
+
+        template <typename F> struct IsStdFunction: std::false_type {};
+        template <typename R, typename... Args> struct IsStdFunction<std::function<R(Args...)>>: std::true_type {};
+
+        template <typename F, typename D>
+        F index_default_function() {
+            if constexpr (IsStdFunction<F>::value)
+                return F(D());
+            else
+                return F();
+        }
+
         template <typename K, typename T>
-        struct IndexMapTraits<K, T, IndexMode::duplicate> {
-            using compare_function = std::function<bool(const K&, const K&)>;
-            using map_type = std::multimap<K, T, compare_function>;
-            using value_type = typename map_type::value_type;
-            static void insert(const K& k, const T& value, map_type& map) {
-                map.insert(value_type(k, value));
+        struct IndexCast {
+            K operator()(const T& t) const { return static_cast<K>(t); }
+        };
+
+        template <typename K, typename T, IndexMode M, typename F> struct IndexMapTraits;
+
+        template <typename K, typename T, typename F>
+        struct IndexMapTraits<K, T, IndexMode::unique, F>:
+        IndexMapOps<K, T, std::map<K, T, F>, true> {
+            using map_type = std::map<K, T, F>;
+            static map_type make() { return map_type(index_default_function<F, std::less<K>>()); }
+            static map_type make(const F& compare) { return map_type(compare); }
+        };
+
+        template <typename K, typename T, typename F>
+        struct IndexMapTraits<K, T, IndexMode::duplicate, F>:
+        IndexMapOps<K, T, std::multimap<K, T, F>, false> {
+            using map_type = std::multimap<K, T, F>;
+            static map_type make() { return map_type(index_default_function<F, std::less<K>>()); }
+            static map_type make(const F& compare) { return map_type(compare); }
+        };
+
+        template <typename K, typename T, typename F>
+        struct IndexMapTraits<K, T, IndexMode::hash_unique, F>:
+        IndexMapOps<K, T, FlatMap<K, T, F>, true> {
+            using map_type = FlatMap<K, T, F>;
+            static map_type make() { return map_type(index_default_function<F, std::hash<K>>()); }
+            static map_type make(const F& hash) { return map_type(hash); }
+            static size_t count(const map_type& map, const K& k) { return map.has(k); }
+            static void erase(const K& k, const T& value, map_type& map) {
+                auto i = map.find(k);
+                if (i != map.end() && i->second == value)
+                    map.erase(i);
+            }
+            template <typename M2> static auto equal_range(M2& map, const K& k) {
+                auto i = map.find(k), j = i;
+                if (j != map.end())
+                    ++j;
+                return std::make_pair(i, j);
             }
         };
 
+        template <typename K, typename T, typename F>
+        struct IndexMapTraits<K, T, IndexMode::hash_duplicate, F>:
+        IndexMapOps<K, T, std::unordered_multimap<K, T, F>, false> {
+            using map_type = std::unordered_multimap<K, T, F>;
+            static map_type make() { return map_type(0, index_default_function<F, std::hash<K>>()); }
+            static map_type make(const F& hash) { return map_type(0, hash); }
+        };
+
+        // Rows live in fixed size chunks that never move, addressed by a
+        // 32-bit slot id. A doubly linked list of slot ids, kept in a
+        // separate array, preserves insertion order; erased slots go on a
+        // free list and are reused. Slots are handed out in order until one
+        // is freed, so a table that is only appended to is scanned in
+        // memory order.
+
+        template <typename T>
+        class IndexStore {
+        public:
+            RS_NO_COPY_MOVE(IndexStore);
+            using id_type = uint32_t;
+            static constexpr id_type npos = ~ id_type(0);
+            IndexStore() = default;
+            ~IndexStore() noexcept;
+            T& operator[](id_type id) noexcept { return chunks[id >> chunk_shift][id & chunk_mask]; }
+            const T& operator[](id_type id) const noexcept { return chunks[id >> chunk_shift][id & chunk_mask]; }
+            void clear() noexcept;
+            template <typename... Args> id_type emplace(Args&&... args);
+            void erase(id_type id) noexcept;
+            id_type first() const noexcept { return head; }
+            id_type next(id_type id) const noexcept { return links[id].next; }
+            id_type prev(id_type id) const noexcept { return id == npos ? tail : links[id].prev; }
+            void reserve(size_t n);
+            size_t size() const noexcept { return count; }
+        private:
+            struct link { id_type prev, next; };
+            static constexpr size_t chunk_shift = ilog2p1(std::max(size_t(16384) / sizeof(T), size_t(64))) - 1;
+            static constexpr size_t chunk_size = size_t(1) << chunk_shift;
+            static constexpr size_t chunk_mask = chunk_size - 1;
+            std::vector<T*> chunks;
+            std::vector<link> links;
+            id_type head = npos;
+            id_type tail = npos;
+            id_type free = npos;
+            size_t count = 0;
+            void add_chunk();
+        };
+
+        template <typename T>
+        IndexStore<T>::~IndexStore() noexcept {
+            clear();
+            for (auto p: chunks)
+                std::allocator<T>().deallocate(p, chunk_size);
+        }
+
+        template <typename T>
+        void IndexStore<T>::clear() noexcept {
+            for (id_type id = head; id != npos; id = links[id].next)
+                (*this)[id].~T();
+            links.clear();
+            head = tail = free = npos;
+            count = 0;
+        }
+
+        template <typename T>
+        template <typename... Args>
+        typename IndexStore<T>::id_type IndexStore<T>::emplace(Args&&... args) {
+            id_type id;
+            if (free != npos) {
+                id = free;
+                new (&(*this)[id]) T(std::forward<Args>(args)...);
+                free = links[id].next;
+            } else {
+                if (links.size() >= npos)
+                    throw std::length_error("Index table is full");
+                id = id_type(links.size());
+                if ((id >> chunk_shift) >= chunks.size())
+                    add_chunk();
+                links.push_back({npos, npos});
+                try {
+                    new (&(*this)[id]) T(std::forward<Args>(args)...);
+                }
+                catch (...) {
+                    links.pop_back();
+                    throw;
+                }
+            }
+            links[id] = {tail, npos};
+            if (tail == npos)
+                head = id;
+            else
+                links[tail].next = id;
+            tail = id;
+            ++count;
+            return id;
+        }
+
+        template <typename T>
+        void IndexStore<T>::erase(id_type id) noexcept {
+            auto& ln = links[id];
+            if (ln.prev == npos)
+                head = ln.next;
+            else
+                links[ln.prev].next = ln.next;
+            if (ln.next == npos)
+                tail = ln.prev;
+            else
+                links[ln.next].prev = ln.prev;
+            (*this)[id].~T();
+            ln.next = free;
+            free = id;
+            --count;
+        }
+
+        template <typename T>
+        void IndexStore<T>::reserve(size_t n) {
+            links.reserve(n);
+            while (chunks.size() * chunk_size < n)
+                add_chunk();
+        }
+
+        template <typename T>
+        void IndexStore<T>::add_chunk() {
+            chunks.reserve(chunks.size() + 1);
+            chunks.push_back(std::allocator<T>().allocate(chunk_size));
+        }
+
         template <typename T>
         class IndexRefBase {
         public:
             RS_NO_COPY_MOVE(IndexRefBase);
-            using list_type = std::list<T>;
-            using list_iterator = typename list_type::iterator;
+            using id_type = typename IndexStore<T>::id_type;
             using value_type = T;
             virtual ~IndexRefBase() = default;
+            virtual size_t bulk_insert(const std::vector<id_type>& ids) = 0;
             virtual void clear() noexcept = 0;
-            virtual void erase(list_iterator i) = 0;
-            virtual void insert(list_iterator i) = 0;
+            virtual void erase(id_type id) = 0;
+            virtual void insert(id_type id) = 0;
         protected:
             IndexRefBase() = default;
         };
 
         template <typename T> class IndexRef;
 
-        template <typename K, typename T, IndexMode M>
-        class IndexRef<Index<K, T, M>>:
+        template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+        class IndexRef<Index<K, T, M, Extract, Compare>>:
         public IndexRefBase<T> {
         public:
             RS_NO_COPY_MOVE(IndexRef);
-            using index_type = Index<K, T, M>;
-            using list_type = std::list<T>;
-            using list_iterator = typename list_type::iterator;
+            using index_type = Index<K, T, M, Extract, Compare>;
+            using id_type = typename IndexStore<T>::id_type;
             using map_traits = typename index_type::map_traits;
             explicit IndexRef(index_type& index) noexcept: ind(index) {}
-            virtual ~IndexRef() noexcept { clear(); }
+            virtual ~IndexRef() noexcept { clear(); ind.tab = nullptr; }
+            virtual size_t bulk_insert(const std::vector<id_type>& ids) { return ind.bulk_insert(ids); }
             virtual void clear() noexcept { ind.map.clear(); }
-            virtual void erase(list_iterator i) { ind.map.erase(ind.ext(*i)); }
-            virtual void insert(list_iterator i) { map_traits::insert(ind.ext(*i), i, ind.map); }
+            virtual void erase(id_type id) { map_traits::erase(ind.ext(ind.tab->store[id]), id, ind.map); }
+            virtual void insert(id_type id) { map_traits::insert(ind.ext(ind.tab->store[id]), id, ind.map); }
         private:
             index_type& ind;
         };
@@ -87,56 +292,132 @@ namespace RS {
     template <typename T>
     class IndexTable {
     private:
-        using list_type = std::list<T>;
+        using store_type = RS_Detail::IndexStore<T>;
+        using id_type = typename store_type::id_type;
+        template <typename CT> class basic_iterator:
+        public BidirectionalIterator<basic_iterator<CT>, CT> {
+        public:
+            basic_iterator() = default;
+            template <typename CT2> basic_iterator(const basic_iterator<CT2>& i): store(i.store), id(i.id) {}
+            CT& operator*() const noexcept { return (*store)[id]; }
+            basic_iterator& operator++() noexcept { id = store->next(id); return *this; }
+            basic_iterator& operator--() noexcept { id = store->prev(id); return *this; }
+            bool operator==(const basic_iterator& rhs) const noexcept { return id == rhs.id; }
+        private:
+            friend class IndexTable;
+            template <typename CT2> friend class basic_iterator;
+            using store_ptr = std::conditional_t<std::is_const<CT>::value, const store_type*, store_type*>;
+            store_ptr store = nullptr;
+            id_type id = store_type::npos;
+            basic_iterator(store_ptr s, id_type i) noexcept: store(s), id(i) {}
+        };
     public:
         RS_NO_COPY_MOVE(IndexTable);
-        using const_iterator = typename list_type::const_iterator;
+        using const_iterator = basic_iterator<const T>;
         using const_reference = const T&;
         using difference_type = ptrdiff_t;
-        using iterator = typename list_type::iterator;
+        using iterator = basic_iterator<T>;
         using reference = T&;
         using size_type = size_t;
         using value_type = T;
         IndexTable() = default;
-        template <typename Range> explicit IndexTable(const Range& src);
-        template <typename Iterator> IndexTable(Iterator i1, Iterator i2);
+        template <typename Range> explicit IndexTable(const Range& src) { insert(src); }
+        template <typename Iterator> IndexTable(Iterator i1, Iterator i2) { insert(i1, i2); }
         ~IndexTable() = default;
-        iterator begin() { return list.begin(); }
-        const_iterator begin() const { return list.begin(); }
+        iterator begin() { return {&store, store.first()}; }
+        const_iterator begin() const { return {&store, store.first()}; }
+        template <typename Range> void bulk_load(const Range& src, size_t threads = 1) { using std::begin; using std::end; bulk_load(begin(src), end(src), threads); }
+        template <typename Iterator> void bulk_load(Iterator i1, Iterator i2, size_t threads = 1);
         void clear();
-        bool empty() const noexcept { return list.empty(); }
-        iterator end() { return list.end(); }
-        const_iterator end() const { return list.end(); }
+        bool empty() const noexcept { return store.size() == 0; }
+        iterator end() { return {&store, store_type::npos}; }
+        const_iterator end() const { return {&store, store_type::npos}; }
         void erase(iterator i);
         void erase(iterator i1, iterator i2);
         void insert(const T& t);
         template <typename Range> void insert(const Range& src) { for (auto& t: src) insert(t); }
         template <typename Iterator> void insert(Iterator i1, Iterator i2) { for (; i1 != i2; ++i1) insert(*i1); }
         void push_back(const T& t) { insert(t); }
-        size_t size() const noexcept { return list.size(); }
+        void reserve(size_t n) { store.reserve(n); }
+        size_t size() const noexcept { return store.size(); }
     private:
-        template <typename K, typename T2, IndexMode M> friend class Index;
+        template <typename K, typename T2, IndexMode M, typename Extract, typename Compare> friend class Index;
+        template <typename I> friend class RS_Detail::IndexRef;
         using ref_base = RS_Detail::IndexRefBase<T>;
         using ref_ptr = std::shared_ptr<ref_base>;
         using ref_map = std::unordered_map<void*, ref_ptr>;
         using ref_pair = typename ref_map::value_type;
         ref_map indices;
-        list_type list;
+        store_type store;
     };
 
-    template <typename T>
-    template <typename Range>
-    IndexTable<T>::IndexTable(const Range& src):
-    indices(), list(begin(src), end(src)) {}
-
     template <typename T>
     template <typename Iterator>
-    IndexTable<T>::IndexTable(Iterator i1, Iterator i2):
-    indices(), list(i1, i2) {}
+    void IndexTable<T>::bulk_load(Iterator i1, Iterator i2, size_t threads) {
+        // Append all the rows, then have each index sort and build its new
+        // entries in one pass; an index that finds collisions is left
+        // unchanged, and on failure everything else is undone
+        static const size_t cpus = Thread::cpu_threads();
+        using category = typename std::iterator_traits<Iterator>::iterator_category;
+        std::vector<id_type> ids;
+        if constexpr (std::is_base_of<std::forward_iterator_tag, category>::value) {
+            auto n = size_t(std::distance(i1, i2));
+            ids.reserve(n);
+            store.reserve(store.size() + n);
+        }
+        std::vector<ref_base*> refs;
+        for (auto& pair: indices)
+            refs.push_back(pair.second.get());
+        std::vector<size_t> collisions(refs.size(), 0);
+        std::vector<char> built(refs.size(), 0);
+        auto undo = [&] {
+            for (size_t r = 0; r < refs.size(); ++r)
+                if (built[r])
+                    for (auto id: ids)
+                        try { refs[r]->erase(id); } catch (...) {}
+            for (auto id: ids)
+                store.erase(id);
+        };
+        try {
+            for (; i1 != i2; ++i1)
+                ids.push_back(store.emplace(*i1));
+            if (threads == 0)
+                threads = cpus;
+            threads = std::min(threads, refs.size());
+            auto build = [&] (size_t first) {
+                for (size_t r = first; r < refs.size(); r += threads) {
+                    collisions[r] = refs[r]->bulk_insert(ids);
+                    built[r] = collisions[r] == 0;
+                }
+            };
+            if (threads <= 1) {
+                build(0);
+            } else {
+                std::vector<Thread> workers;
+                workers.reserve(threads - 1);
+                for (size_t w = 1; w < threads; ++w)
+                    workers.emplace_back([&build, w] { build(w); });
+                build(0);
+                for (auto& w: workers)
+                    w.wait();
+            }
+        }
+        catch (...) {
+            undo();
+            throw;
+        }
+        size_t total = 0;
+        for (auto n: collisions)
+            total += n;
+        if (total) {
+            undo();
+            throw IndexCollision(total);
+        }
+    }
 
     template <typename T>
     void IndexTable<T>::clear() {
-        list.clear();
+        store.clear();
         for (auto& pair: indices)
             pair.second->clear();
     }
@@ -144,59 +425,62 @@ namespace RS {
     template <typename T>
     void IndexTable<T>::erase(iterator i) {
         for (auto& pair: indices)
-            pair.second->erase(i);
-        list.erase(i);
+            pair.second->erase(i.id);
+        store.erase(i.id);
     }
 
     template <typename T>
     void IndexTable<T>::erase(iterator i1, iterator i2) {
-        for (iterator i = i1; i != i2; ++i)
-            for (auto& pair: indices)
-                pair.second->erase(i);
-        list.erase(i1, i2);
+        while (i1 != i2)
+            erase(i1++);
     }
 
     template <typename T>
     void IndexTable<T>::insert(const T& t) {
         ScopedTransaction txn;
-        txn.call([&] { list.push_back(t); }, [&] { list.pop_back(); });
-        iterator i = std::prev(end());
+        id_type id = store_type::npos;
+        txn.call([&] { id = store.emplace(t); }, [&] { store.erase(id); });
         for (auto& pair: indices)
-            txn.call([&] { pair.second->insert(i); }, [&] { pair.second->erase(i); });
+            txn.call([&] { pair.second->insert(id); }, [&] { pair.second->erase(id); });
         txn.commit();
     }
 
-    template <typename K, typename T, IndexMode M>
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
     class Index {
     private:
         RS_NO_COPY_MOVE(Index);
-        using list_type = std::list<T>;
-        using list_iterator = typename list_type::iterator;
-        using map_traits = RS_Detail::IndexMapTraits<K, list_iterator, M>;
+        using store_type = RS_Detail::IndexStore<T>;
+        using id_type = typename store_type::id_type;
+        using map_traits = RS_Detail::IndexMapTraits<K, id_type, M, Compare>;
         using map_type = typename map_traits::map_type;
+        static constexpr bool hashed = M == IndexMode::hash_unique || M == IndexMode::hash_duplicate;
         using map_const_iterator = typename map_type::const_iterator;
         using map_iterator = typename map_type::iterator;
         template <typename CT, typename MapIter> class basic_iterator:
-        public BidirectionalIterator<basic_iterator<CT, MapIter>, CT> {
+        public std::conditional_t<hashed, ForwardIterator<basic_iterator<CT, MapIter>, CT>,
+            BidirectionalIterator<basic_iterator<CT, MapIter>, CT>> {
         public:
             basic_iterator() = default;
-            basic_iterator(const basic_iterator<T, map_iterator>& i): iter(i.iter) {}
-            CT& operator*() const noexcept { return *iter->second; }
+            basic_iterator(const basic_iterator<T, map_iterator>& i): iter(i.iter), store(i.store) {}
+            CT& operator*() const noexcept { return (*store)[iter->second]; }
             basic_iterator& operator++() { ++iter; return *this; }
             basic_iterator& operator--() { --iter; return *this; }
             bool operator==(const basic_iterator& rhs) const noexcept { return iter == rhs.iter; }
             const K& key() const noexcept { return iter->first; }
         private:
             friend class Index;
+            using store_ptr = std::conditional_t<std::is_const<CT>::value, const store_type*, store_type*>;
             MapIter iter;
-            basic_iterator(MapIter i): iter(i) {}
+            store_ptr store = nullptr;
+            basic_iterator(MapIter i, store_ptr s): iter(i), store(s) {}
         };
     public:
-        using compare_function = std::function<bool(const K&, const K&)>;
+        using compare_function = std::conditional_t<hashed, std::function<bool(const K&, const K&)>, Compare>;
         using const_iterator = basic_iterator<const T, map_const_iterator>;
         using const_reference = const T&;
         using difference_type = ptrdiff_t;
-        using extract_function = std::function<K(const T&)>;
+        using extract_function = Extract;
+        using hash_function = std::conditional_t<hashed, Compare, std::function<size_t(const K&)>>;
         using iterator = basic_iterator<T, map_iterator>;
         using key_type = K;
         using reference = T&;
@@ -206,74 +490,77 @@ namespace RS {
         static constexpr IndexMode mode = M;
         Index() = default;
         explicit Index(table_type& table);
-        Index(table_type& table, extract_function extract): tab(&table), ext(extract), map(std::less<K>()) { init(); }
-        Index(table_type& table, extract_function extract, compare_function compare): tab(&table), ext(extract), map(compare) { init(); }
+        Index(table_type& table, extract_function extract): tab(&table), ext(extract), map(map_traits::make()) { init(); }
+        Index(table_type& table, extract_function extract, compare_function compare): tab(&table), ext(extract), map(map_traits::make(compare)) { init(); }
+        Index(table_type& table, extract_function extract, hash_function hash): tab(&table), ext(extract), map(map_traits::make(hash)) { init(); }
         ~Index() noexcept { if (tab) tab->indices.erase(this); }
-        iterator begin() { return map.begin(); }
-        const_iterator begin() const { return map.begin(); }
+        iterator begin() { return make_iterator(map.begin()); }
+        const_iterator begin() const { return make_iterator(map.begin()); }
         compare_function compare() const { return map.key_comp(); }
-        size_t count(const K& k) const noexcept { return map.count(k); }
+        size_t count(const K& k) const noexcept { return map_traits::count(map, k); }
         bool empty() const noexcept { return map.empty(); }
-        iterator end() { return map.end(); }
-        const_iterator end() const { return map.end(); }
+        iterator end() { return make_iterator(map.end()); }
+        const_iterator end() const { return make_iterator(map.end()); }
         Irange<iterator> equal_range(const K& k);
         Irange<const_iterator> equal_range(const K& k) const;
         void erase(iterator i);
         void erase(iterator i1, iterator i2);
         void erase(const K& k);
         extract_function extract() const { return ext; }
-        iterator find(const K& k) { return map.find(k); }
-        const_iterator find(const K& k) const { return map.find(k); }
-        iterator lower_bound(const K& k) { return map.lower_bound(k); }
-        const_iterator lower_bound(const K& k) const { return map.lower_bound(k); }
+        hash_function hash() const { return map.hash_function(); }
+        iterator find(const K& k) { return make_iterator(map.find(k)); }
+        const_iterator find(const K& k) const { return make_iterator(map.find(k)); }
+        iterator lower_bound(const K& k) { return make_iterator(map.lower_bound(k)); }
+        const_iterator lower_bound(const K& k) const { return make_iterator(map.lower_bound(k)); }
         size_t size() const noexcept { return map.size(); }
         table_type& table() noexcept { return *tab; }
         const table_type& table() const noexcept { return *tab; }
-        iterator upper_bound(const K& k) { return map.upper_bound(k); }
-        const_iterator upper_bound(const K& k) const { return map.upper_bound(k); }
+        iterator upper_bound(const K& k) { return make_iterator(map.upper_bound(k)); }
+        const_iterator upper_bound(const K& k) const { return make_iterator(map.upper_bound(k)); }
     private:
         friend class IndexTable<T>;
         friend class RS_Detail::IndexRef<Index>;
-        using table_iterator = typename table_type::iterator;
         using ref_type = RS_Detail::IndexRef<Index>;
         table_type* tab = nullptr;
         extract_function ext;
         map_type map;
+        iterator make_iterator(map_iterator i) noexcept { return {i, tab ? &tab->store : nullptr}; }
+        const_iterator make_iterator(map_const_iterator i) const noexcept { return {i, tab ? &tab->store : nullptr}; }
+        size_t bulk_insert(const std::vector<id_type>& ids);
         void init();
     };
 
-    template <typename K, typename T, IndexMode M>
-    Index<K, T, M>::Index(table_type& table):
-    tab(&table), ext(), map(std::less<K>()) {
-        ext = [] (const T& t) { return static_cast<K>(t); };
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    Index<K, T, M, Extract, Compare>::Index(table_type& table):
+    tab(&table), ext(RS_Detail::index_default_function<Extract, RS_Detail::IndexCast<K, T>>()), map(map_traits::make()) {
         init();
     }
 
-    template <typename K, typename T, IndexMode M>
-    Irange<typename Index<K, T, M>::iterator> Index<K, T, M>::equal_range(const K& k) {
-        auto pair = map.equal_range(k);
-        return {pair.first, pair.second};
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    Irange<typename Index<K, T, M, Extract, Compare>::iterator> Index<K, T, M, Extract, Compare>::equal_range(const K& k) {
+        auto pair = map_traits::equal_range(map, k);
+        return {make_iterator(pair.first), make_iterator(pair.second)};
     }
 
-    template <typename K, typename T, IndexMode M>
-    Irange<typename Index<K, T, M>::const_iterator> Index<K, T, M>::equal_range(const K& k) const {
-        auto pair = map.equal_range(k);
-        return {pair.first, pair.second};
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    Irange<typename Index<K, T, M, Extract, Compare>::const_iterator> Index<K, T, M, Extract, Compare>::equal_range(const K& k) const {
+        auto pair = map_traits::equal_range(map, k);
+        return {make_iterator(pair.first), make_iterator(pair.second)};
     }
 
-    template <typename K, typename T, IndexMode M>
-    void Index<K, T, M>::erase(iterator i) {
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    void Index<K, T, M, Extract, Compare>::erase(iterator i) {
         auto m = i.iter;
         auto t = m->second;
         for(auto& pair: tab->indices)
             if (pair.first != this)
                 pair.second->erase(t);
-        tab->list.erase(t);
+        tab->store.erase(t);
         map.erase(m);
     }
 
-    template <typename K, typename T, IndexMode M>
-    void Index<K, T, M>::erase(iterator i1, iterator i2) {
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    void Index<K, T, M, Extract, Compare>::erase(iterator i1, iterator i2) {
         auto next = i1;
         while (i1 != i2) {
             ++next;
@@ -282,23 +569,89 @@ namespace RS {
         }
     }
 
-    template <typename K, typename T, IndexMode M>
-    void Index<K, T, M>::erase(const K& k) {
-        auto m = map.find(k);
-        if (m != map.end()) {
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    void Index<K, T, M, Extract, Compare>::erase(const K& k) {
+        for (auto m = map.find(k); m != map.end(); m = map.find(k)) {
             auto t = m->second;
             for(auto& pair: tab->indices)
                 if (pair.first != this)
                     pair.second->erase(t);
-            tab->list.erase(t);
+            tab->store.erase(t);
             map.erase(m);
         }
     }
 
-    template <typename K, typename T, IndexMode M>
-    void Index<K, T, M>::init() {
-        for (auto t = tab->begin(), e = tab->end(); t != e; ++t)
-            map_traits::insert(ext(*t), t, map);
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    size_t Index<K, T, M, Extract, Compare>::bulk_insert(const std::vector<id_type>& ids) {
+        // Returns the number of collisions, leaving the index unchanged if
+        // there were any
+        auto& store = tab->store;
+        if constexpr (! hashed) {
+            if (ids.size() >= map.size()) {
+                // Sort the new entries, merge them with the existing ones,
+                // and rebuild the tree from the sorted list in linear time;
+                // stable sorting and merging keep equal keys in order of
+                // insertion
+                using entry = std::pair<K, id_type>;
+                auto comp = map.key_comp();
+                auto less = [&comp] (const auto& a, const auto& b) { return comp(a.first, b.first); };
+                std::vector<entry> add;
+                add.reserve(ids.size());
+                for (auto id: ids)
+                    add.emplace_back(ext(store[id]), id);
+                std::stable_sort(add.begin(), add.end(), less);
+                if (! map.empty()) {
+                    std::vector<entry> all;
+                    all.reserve(map.size() + add.size());
+                    std::merge(map.begin(), map.end(), add.begin(), add.end(), std::back_inserter(all), less);
+                    add.swap(all);
+                }
+                if constexpr (M == IndexMode::unique) {
+                    size_t n = 0;
+                    for (size_t i = 1; i < add.size(); ++i)
+                        n += size_t(! less(add[i - 1], add[i]));
+                    if (n)
+                        return n;
+                }
+                map_type temp(comp);
+                for (auto& e: add)
+                    temp.emplace_hint(temp.end(), std::move(e.first), e.second);
+                map.swap(temp);
+                return 0;
+            }
+        }
+        // Otherwise insert one at a time, undoing on failure; erasing an
+        // entry that was never inserted is harmless
+        size_t done = 0, n = 0;
+        auto undo = [&] {
+            for (size_t i = 0; i < done; ++i)
+                try { map_traits::erase(ext(store[ids[i]]), ids[i], map); } catch (...) {}
+        };
+        try {
+            if constexpr (hashed)
+                map.reserve(map.size() + ids.size());
+            for (; done < ids.size(); ++done)
+                n += size_t(! map_traits::try_insert(ext(store[ids[done]]), ids[done], map));
+        }
+        catch (...) {
+            undo();
+            throw;
+        }
+        if (n)
+            undo();
+        return n;
+    }
+
+    template <typename K, typename T, IndexMode M, typename Extract, typename Compare>
+    void Index<K, T, M, Extract, Compare>::init() {
+        auto& store = tab->store;
+        std::vector<id_type> ids;
+        ids.reserve(store.size());
+        for (auto id = store.first(); id != store_type::npos; id = store.next(id))
+            ids.push_back(id);
+        size_t n = bulk_insert(ids);
+        if (n)
+            throw IndexCollision(n);
         tab->indices[this] = std::make_shared<ref_type>(*this);
     }
 
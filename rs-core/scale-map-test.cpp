@@ -1,5 +1,8 @@
 #include "rs-core/scale-map.hpp"
 #include "rs-core/unit-test.hpp"
+#include <algorithm>
+#include <random>
+#include <vector>
 
 using namespace RS;
 
@@ -202,10 +205,104 @@ namespace {
 
     }
 
+    void check_compiled_scale_map() {
+
+        ScaleMap<double> sm;
+        std::vector<double> in(5), out(5);
+
+        TRY(sm.compile());
+        TEST(sm.compiled());
+        TEST_EQUAL(sm(10), 0);
+        TRY(sm.evaluate(in.data(), out.data(), in.size()));
+        TEST_EQUAL(out[0], 0);
+
+        TRY((sm = {
+            {10, 100},
+            {20, 200, 300, 400},
+            {30, 500, 600},
+        }));
+        TEST(! sm.compiled());
+        in = {5, 15, 20, 25, 35};
+        TRY(sm.evaluate(in.data(), out.data(), in.size()));
+        TEST_EQUAL(out[0], 100);
+        TEST_EQUAL(out[1], 150);
+        TEST_EQUAL(out[2], 300);
+        TEST_EQUAL(out[3], 450);
+        TEST_EQUAL(out[4], 600);
+
+        TRY(sm.compile(4));
+        TEST(sm.compiled());
+        TEST_EQUAL(sm(5), 100);
+        TEST_EQUAL(sm(10), 100);
+        TEST_EQUAL(sm(15), 150);
+        TEST_EQUAL(sm(20), 300);
+        TEST_EQUAL(sm(25), 450);
+        TEST_EQUAL(sm(30), 550);
+        TEST_EQUAL(sm(35), 600);
+        std::reverse(in.begin(), in.end());
+        TRY(sm.evaluate(in.data(), out.data(), in.size()));
+        TEST_EQUAL(out[0], 600);
+        TEST_EQUAL(out[1], 450);
+        TEST_EQUAL(out[2], 300);
+        TEST_EQUAL(out[3], 150);
+        TEST_EQUAL(out[4], 100);
+
+        TRY(sm.insert(40, 1000));
+        TEST(! sm.compiled());
+        TEST_EQUAL(sm(35), 800);
+        TRY(sm.compile());
+        TEST_EQUAL(sm(35), 800);
+        TRY(sm.scale_y(2));
+        TEST(! sm.compiled());
+        TEST_EQUAL(sm(35), 1600);
+
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<double> key(0, 100), dist(-10, 110);
+        sm.clear();
+        for (int i = 0; i < 200; ++i) {
+            double x = key(rng);
+            if (i % 10 == 0)
+                sm.insert(x, x, - x);
+            else
+                sm.insert(x, x * x);
+        }
+
+        std::vector<double> random(10000), sorted, expect, got(random.size());
+        for (auto& x: random)
+            x = dist(rng);
+        sm.insert(random[0], 42);
+        sm.insert(random[1], 43);
+        sorted = random;
+        std::sort(sorted.begin(), sorted.end());
+        int errors;
+
+        for (auto* vec: {&random, &sorted}) {
+            expect.clear();
+            for (auto x: *vec)
+                expect.push_back(sm(x));
+            for (size_t cells: {0, 1, 7, 200, 5000}) {
+                TRY(sm.compile(cells));
+                errors = 0;
+                for (size_t i = 0; i < vec->size(); ++i)
+                    errors += int(sm((*vec)[i]) != expect[i]);
+                TEST_EQUAL(errors, 0);
+                TRY(sm.evaluate(vec->data(), got.data(), vec->size()));
+                TEST(got == expect);
+            }
+            TRY(sm.insert(-1000, 0));
+            TRY(sm.erase(-1000));
+            TEST(! sm.compiled());
+            TRY(sm.evaluate(vec->data(), got.data(), vec->size()));
+            TEST(got == expect);
+        }
+
+    }
+
 }
 
 TEST_MODULE(core, scale_map) {
 
     check_scale_map();
+    check_compiled_scale_map();
 
 }
@@ -8,6 +8,7 @@
 #include <map>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace RS {
 
@@ -24,21 +25,37 @@ namespace RS {
         };
         struct y_values { Y left, mid, right; };
         using map_type = std::map<X, y_values>;
+        struct compiled_map {
+            std::vector<X> xs;
+            std::vector<y_values> ys;
+            std::vector<size_t> table;
+            X scale = X(0);
+            void build(const map_type& map, size_t cells);
+            size_t cell(X x) const noexcept;
+            size_t find(X x, size_t hint) const noexcept;
+            Y value(size_t i, X x) const;
+        };
         map_type map;
+        compiled_map frozen;
+        bool is_compiled = false;
         static inline Y mid(Y y1, Y y2) noexcept { return interpolate(X(0), y1, X(2), y2, X(1)); }
+        void thaw() noexcept { frozen = {}; is_compiled = false; }
     public:
         using key_type = X;
         using mapped_type = Y;
         ScaleMap() = default;
         ScaleMap(std::initializer_list<init_type> list);
         Y operator()(X x) const;
-        void clear() noexcept { map.clear(); }
+        void clear() noexcept { thaw(); map.clear(); }
+        void compile(size_t cells = 0);
+        bool compiled() const noexcept { return is_compiled; }
         bool empty() const noexcept { return map.empty(); }
-        void erase(X x) noexcept { map.erase(x); }
+        void erase(X x) noexcept { thaw(); map.erase(x); }
         void erase(X x1, X x2) noexcept;
-        void insert(X x, Y y) { map[x] = {y, y, y}; }
-        void insert(X x, Y yl, Y yr) { map[x] = {yl, mid(yl, yr), yr}; }
-        void insert(X x, Y yl, Y y, Y yr) { map[x] = {yl, y, yr}; }
+        void evaluate(const X* in, Y* out, size_t n) const;
+        void insert(X x, Y y) { thaw(); map[x] = {y, y, y}; }
+        void insert(X x, Y yl, Y yr) { thaw(); map[x] = {yl, mid(yl, yr), yr}; }
+        void insert(X x, Y yl, Y y, Y yr) { thaw(); map[x] = {yl, y, yr}; }
         X min() const noexcept { return map.empty() ? X(0) : map.begin()->first; }
         X max() const noexcept { return map.empty() ? X(0) : std::prev(map.end())->first; }
         template <typename T> void scale_x(T a, X b = X(0));
@@ -55,6 +72,12 @@ namespace RS {
     Y ScaleMap<X, Y>::operator()(X x) const {
         if (map.empty())
             return Y();
+        if (is_compiled) {
+            if (frozen.table.empty())
+                return frozen.value(std::lower_bound(frozen.xs.begin(), frozen.xs.end(), x) - frozen.xs.begin(), x);
+            else
+                return frozen.value(frozen.find(x, frozen.table[frozen.cell(x)]), x);
+        }
         auto i = map.lower_bound(x);
         if (i == map.end())
             return std::prev(i)->second.right;
@@ -66,8 +89,16 @@ namespace RS {
         return interpolate(j->first, j->second.right, i->first, i->second.left, x);
     }
 
+    template <typename X, typename Y>
+    void ScaleMap<X, Y>::compile(size_t cells) {
+        thaw();
+        frozen.build(map, cells);
+        is_compiled = true;
+    }
+
     template <typename X, typename Y>
     void ScaleMap<X, Y>::erase(X x1, X x2) noexcept {
+        thaw();
         if (x1 > x2)
             std::swap(x1, x2);
         auto i = map.lower_bound(x1);
@@ -75,10 +106,34 @@ namespace RS {
         map.erase(i, j);
     }
 
+    template <typename X, typename Y>
+    void ScaleMap<X, Y>::evaluate(const X* in, Y* out, size_t n) const {
+        if (map.empty()) {
+            std::fill_n(out, n, Y());
+            return;
+        }
+        compiled_map temp;
+        if (! is_compiled)
+            temp.build(map, 0);
+        auto& c = is_compiled ? frozen : temp;
+        size_t hint = 0;
+        for (size_t k = 0; k < n; ++k) {
+            X x = in[k];
+            // With a table, each search starts from the cell containing x;
+            // otherwise from the previous result, so sorted or nearly
+            // sorted input usually lands in the same or a nearby interval
+            if (! c.table.empty())
+                hint = c.table[c.cell(x)];
+            hint = c.find(x, hint);
+            out[k] = c.value(hint, x);
+        }
+    }
+
     template <typename X, typename Y>
     template <typename T>
     void ScaleMap<X, Y>::scale_x(T a, X b) {
         static_assert(std::is_arithmetic<T>::value);
+        thaw();
         if (map.empty()) {
             // do nothing
         } else if (a == T(0)) {
@@ -107,6 +162,7 @@ namespace RS {
     template <typename T>
     void ScaleMap<X, Y>::scale_y(T a, Y b) {
         static_assert(std::is_arithmetic<T>::value);
+        thaw();
         for (auto& xy: map) {
             xy.second.left = a * xy.second.left + b;
             xy.second.mid = a * xy.second.mid + b;
@@ -114,4 +170,75 @@ namespace RS {
         }
     }
 
+    template <typename X, typename Y>
+    void ScaleMap<X, Y>::compiled_map::build(const map_type& map, size_t cells) {
+        xs.reserve(map.size());
+        ys.reserve(map.size());
+        for (auto& xy: map) {
+            xs.push_back(xy.first);
+            ys.push_back(xy.second);
+        }
+        if (cells == 0 || xs.size() < 2)
+            return;
+        // Cell k starts at the first entry whose x falls in cell k or later;
+        // any x in cell k then has its lower bound in [table[k],table[k+1]]
+        scale = X(cells) / (xs.back() - xs.front());
+        table.resize(cells + 1);
+        size_t i = 0;
+        for (size_t k = 0; k <= cells; ++k) {
+            while (i < xs.size() && cell(xs[i]) < k)
+                ++i;
+            table[k] = i;
+        }
+    }
+
+    template <typename X, typename Y>
+    size_t ScaleMap<X, Y>::compiled_map::cell(X x) const noexcept {
+        // Written to be monotonic in x, and to send NaN to cell zero
+        size_t cells = table.size() - 1;
+        X pos = (x - xs.front()) * scale;
+        if (! (pos > X(0)))
+            return 0;
+        if (pos >= X(cells))
+            return cells - 1;
+        return std::min(size_t(pos), cells - 1);
+    }
+
+    template <typename X, typename Y>
+    size_t ScaleMap<X, Y>::compiled_map::find(X x, size_t hint) const noexcept {
+        // Returns the lower bound of x, galloping outward from the hint
+        size_t size = xs.size();
+        if (hint < size && xs[hint] < x) {
+            size_t lo = hint + 1, hi = lo, step = 1;
+            while (hi < size && xs[hi] < x) {
+                lo = hi + 1;
+                hi += step;
+                step *= 2;
+            }
+            hi = std::min(hi, size);
+            return std::lower_bound(xs.begin() + lo, xs.begin() + hi, x) - xs.begin();
+        } else if (hint > 0 && xs[hint - 1] >= x) {
+            size_t hi = hint - 1, lo = hi, step = 1;
+            while (lo > 0 && xs[lo - 1] >= x) {
+                hi = lo - 1;
+                lo = lo > step ? lo - step : 0;
+                step *= 2;
+            }
+            return std::lower_bound(xs.begin() + lo, xs.begin() + hi, x) - xs.begin();
+        } else {
+            return hint;
+        }
+    }
+
+    template <typename X, typename Y>
+    Y ScaleMap<X, Y>::compiled_map::value(size_t i, X x) const {
+        if (i == xs.size())
+            return ys[i - 1].right;
+        if (xs[i] == x)
+            return ys[i].mid;
+        if (i == 0)
+            return ys[0].left;
+        return interpolate(xs[i - 1], ys[i - 1].right, xs[i], ys[i].left, x);
+    }
+
 }
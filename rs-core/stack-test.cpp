@@ -1,7 +1,11 @@
 #include "rs-core/stack.hpp"
 #include "rs-core/string.hpp"
+#include "rs-core/thread.hpp"
 #include "rs-core/unit-test.hpp"
+#include <algorithm>
+#include <memory>
 #include <ostream>
+#include <vector>
 
 using namespace RS;
 
@@ -53,10 +57,121 @@ namespace {
 
     }
 
+    void check_small_stack() {
+
+        SmallStack<TopTail, 2> st;
+        U8string s;
+
+        TEST(st.empty());
+        TEST_EQUAL(st.capacity(), 2);
+        TEST_EQUAL(to_str(st), "[]");
+        TRY(st.emplace(s, 'a'));
+        TRY(st.emplace(s, 'b'));
+        TEST_EQUAL(st.size(), 2);
+        TEST_EQUAL(st.capacity(), 2);
+        TEST_EQUAL(st.top().get(), 'b');
+        TEST_EQUAL(to_str(st), "[a,b]");
+        TEST_EQUAL(s, "+a+b");
+        TRY(st.emplace(s, 'c'));
+        TEST_EQUAL(st.size(), 3);
+        TEST_EQUAL(st.capacity(), 4);
+        TEST_EQUAL(st.top().get(), 'c');
+        TEST_EQUAL(to_str(st), "[a,b,c]");
+        TEST_EQUAL(s, "+a+b+c");
+        TRY(st.pop());
+        TEST_EQUAL(st.size(), 2);
+        TEST_EQUAL(s, "+a+b+c-c");
+        TRY(st.emplace(s, 'd'));
+        TRY(st.clear());
+        TEST(st.empty());
+        TEST_EQUAL(to_str(st), "[]");
+        TEST_EQUAL(s, "+a+b+c-c+d-d-b-a");
+
+        SmallStack<std::unique_ptr<int>, 4> st1, st2;
+
+        for (int i = 1; i <= 3; ++i)
+            TRY(st1.push(std::make_unique<int>(i)));
+        TRY(st2 = std::move(st1));
+        TEST(st1.empty());
+        REQUIRE(st2.size() == 3);
+        TEST_EQUAL(*st2.top(), 3);
+        for (int i = 4; i <= 10; ++i)
+            TRY(st1.push(std::make_unique<int>(i)));
+        TEST_EQUAL(st1.capacity(), 8);
+        TRY(st2 = std::move(st1));
+        TEST(st1.empty());
+        TEST_EQUAL(st1.capacity(), 4);
+        REQUIRE(st2.size() == 7);
+        TEST_EQUAL(*st2.top(), 10);
+        TEST_EQUAL(st2.capacity(), 8);
+
+        SmallStack<U8string, 1> st3;
+
+        TRY(st3.push("hello"));
+        TRY(st3.push(st3.top()));
+        TRY(st3.push(st3.top()));
+        TEST_EQUAL(to_str(st3), "[hello,hello,hello]");
+
+    }
+
+    void check_concurrent_stack() {
+
+        ConcurrentStack<int> st;
+        int n = 0;
+
+        TEST(st.empty());
+        TEST(! st.pop(n));
+        TRY(st.push(1));
+        TRY(st.push(2));
+        TRY(st.push(3));
+        TEST(! st.empty());
+        TEST(st.pop(n));
+        TEST_EQUAL(n, 3);
+        TEST(st.pop(n));
+        TEST_EQUAL(n, 2);
+        TRY(st.clear());
+        TEST(st.empty());
+        TEST(! st.pop(n));
+
+        static constexpr int threads = 4;
+        static constexpr int per_thread = 10000;
+        std::vector<int> popped[threads];
+        std::vector<std::unique_ptr<Thread>> workers;
+
+        for (int t = 0; t < threads; ++t) {
+            workers.push_back(std::make_unique<Thread>([&st, &popped, t] {
+                int x = 0;
+                for (int i = 0; i < per_thread; ++i) {
+                    st.push(t * per_thread + i);
+                    if (i % 2 && st.pop(x))
+                        popped[t].push_back(x);
+                }
+            }));
+        }
+        for (auto& w: workers)
+            TRY(w->wait());
+
+        std::vector<int> all;
+        for (auto& p: popped)
+            all.insert(all.end(), p.begin(), p.end());
+        while (st.pop(n))
+            all.push_back(n);
+        TEST_EQUAL(all.size(), size_t(threads * per_thread));
+        std::sort(all.begin(), all.end());
+        for (int i = 0; i < threads * per_thread && i < int(all.size()); ++i)
+            if (all[i] != i) {
+                TEST_EQUAL(all[i], i);
+                break;
+            }
+
+    }
+
 }
 
 TEST_MODULE(core, stack) {
 
     check_stack();
+    check_small_stack();
+    check_concurrent_stack();
 
 }
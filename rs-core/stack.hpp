@@ -1,6 +1,9 @@
 #pragma once
 
 #include "rs-core/common.hpp"
+#include <atomic>
+#include <memory>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
@@ -35,4 +38,241 @@ namespace RS {
         std::vector<T> con;
     };
 
+    template <typename T, size_t N>
+    class SmallStack {
+    public:
+        static_assert(N > 0, "SmallStack inline capacity must not be zero");
+        using const_iterator = const T*;
+        using iterator = T*;
+        using value_type = T;
+        static constexpr size_t inline_capacity = N;
+        SmallStack() = default;
+        ~SmallStack() noexcept { clear(); release(); }
+        SmallStack(const SmallStack&) = delete;
+        SmallStack(SmallStack&& s) noexcept(std::is_nothrow_move_constructible<T>::value) { take(s); }
+        SmallStack& operator=(const SmallStack&) = delete;
+        SmallStack& operator=(SmallStack&& s) noexcept(std::is_nothrow_move_constructible<T>::value);
+        iterator begin() noexcept { return ptr; }
+        const_iterator begin() const noexcept { return ptr; }
+        iterator end() noexcept { return ptr + len; }
+        const_iterator end() const noexcept { return ptr + len; }
+        size_t capacity() const noexcept { return cap; }
+        void clear() noexcept { while (len) ptr[--len].~T(); }
+        template <typename... Args> void emplace(Args&&... args);
+        bool empty() const noexcept { return len == 0; }
+        void pop() noexcept { ptr[--len].~T(); }
+        void push(const T& t) { emplace(t); }
+        void push(T&& t) { emplace(std::move(t)); }
+        size_t size() const noexcept { return len; }
+        T& top() noexcept { return ptr[len - 1]; }
+        const T& top() const noexcept { return ptr[len - 1]; }
+    private:
+        alignas(T) unsigned char buf[N * sizeof(T)];
+        T* ptr = reinterpret_cast<T*>(buf);
+        size_t len = 0;
+        size_t cap = N;
+        bool is_inline() const noexcept { return ptr == reinterpret_cast<const T*>(buf); }
+        void release() noexcept;
+        void take(SmallStack& s);
+    };
+
+    template <typename T, size_t N>
+    SmallStack<T, N>& SmallStack<T, N>::operator=(SmallStack&& s) noexcept(std::is_nothrow_move_constructible<T>::value) {
+        if (&s != this) {
+            clear();
+            release();
+            take(s);
+        }
+        return *this;
+    }
+
+    template <typename T, size_t N>
+    template <typename... Args>
+    void SmallStack<T, N>::emplace(Args&&... args) {
+        if (len < cap) {
+            new (ptr + len) T(std::forward<Args>(args)...);
+            ++len;
+            return;
+        }
+        // Construct the new element before moving the old ones, in case the
+        // arguments refer to an existing element
+        std::allocator<T> alloc;
+        size_t new_cap = 2 * cap;
+        T* new_ptr = alloc.allocate(new_cap);
+        size_t i = 0;
+        try {
+            new (new_ptr + len) T(std::forward<Args>(args)...);
+            try {
+                for (; i < len; ++i)
+                    new (new_ptr + i) T(std::move_if_noexcept(ptr[i]));
+            }
+            catch (...) {
+                while (i)
+                    new_ptr[--i].~T();
+                new_ptr[len].~T();
+                throw;
+            }
+        }
+        catch (...) {
+            alloc.deallocate(new_ptr, new_cap);
+            throw;
+        }
+        for (i = len; i; --i)
+            ptr[i - 1].~T();
+        release();
+        ptr = new_ptr;
+        cap = new_cap;
+        ++len;
+    }
+
+    template <typename T, size_t N>
+    void SmallStack<T, N>::release() noexcept {
+        if (! is_inline()) {
+            std::allocator<T>().deallocate(ptr, cap);
+            ptr = reinterpret_cast<T*>(buf);
+            cap = N;
+        }
+    }
+
+    template <typename T, size_t N>
+    void SmallStack<T, N>::take(SmallStack& s) {
+        // Expects this to be empty and inline
+        if (s.is_inline()) {
+            try {
+                for (; len < s.len; ++len)
+                    new (ptr + len) T(std::move(s.ptr[len]));
+            }
+            catch (...) {
+                clear();
+                throw;
+            }
+            s.clear();
+        } else {
+            ptr = s.ptr;
+            len = s.len;
+            cap = s.cap;
+            s.ptr = reinterpret_cast<T*>(s.buf);
+            s.len = 0;
+            s.cap = N;
+        }
+    }
+
+    template <typename T>
+    class ConcurrentStack {
+    public:
+        using value_type = T;
+        ConcurrentStack() = default;
+        ~ConcurrentStack() noexcept;
+        RS_NO_COPY_MOVE(ConcurrentStack)
+        void clear() noexcept;
+        template <typename... Args> void emplace(Args&&... args) { push_node(new node(std::forward<Args>(args)...)); }
+        bool empty() const noexcept { return head == nullptr; }
+        bool pop(T& t);
+        void push(const T& t) { emplace(t); }
+        void push(T&& t) { emplace(std::move(t)); }
+    private:
+        struct node {
+            T value;
+            node* next = nullptr;
+            node* next_pending = nullptr;
+            template <typename... Args> explicit node(Args&&... args): value(std::forward<Args>(args)...) {}
+        };
+        std::atomic<node*> head {nullptr};
+        std::atomic<node*> pending {nullptr};
+        std::atomic<size_t> poppers {0};
+        void push_node(node* n) noexcept;
+        void reclaim(node* first, node* last) noexcept;
+        void defer(node* first, node* last) noexcept;
+        static void delete_pending(node* n) noexcept;
+    };
+
+    template <typename T>
+    ConcurrentStack<T>::~ConcurrentStack() noexcept {
+        for (node* n = head.load(); n;) {
+            node* next = n->next;
+            delete n;
+            n = next;
+        }
+        delete_pending(pending.load());
+    }
+
+    template <typename T>
+    void ConcurrentStack<T>::clear() noexcept {
+        ++poppers;
+        node* first = head.exchange(nullptr);
+        if (first) {
+            node* last = first;
+            for (; last->next; last = last->next)
+                last->next_pending = last->next;
+            reclaim(first, last);
+        } else {
+            --poppers;
+        }
+    }
+
+    template <typename T>
+    bool ConcurrentStack<T>::pop(T& t) {
+        // A popped node can't be deleted while another thread may be
+        // looking at it, so nodes are only deleted when no other pop is in
+        // progress. This also protects against ABA, because a node's address
+        // can't be reused while any thread still holds a pointer to it.
+        ++poppers;
+        node* n = head.load();
+        while (n && ! head.compare_exchange_weak(n, n->next)) {}
+        if (! n) {
+            --poppers;
+            return false;
+        }
+        try {
+            t = std::move(n->value);
+        }
+        catch (...) {
+            reclaim(n, n);
+            throw;
+        }
+        reclaim(n, n);
+        return true;
+    }
+
+    template <typename T>
+    void ConcurrentStack<T>::push_node(node* n) noexcept {
+        n->next = head.load();
+        while (! head.compare_exchange_weak(n->next, n)) {}
+    }
+
+    template <typename T>
+    void ConcurrentStack<T>::reclaim(node* first, node* last) noexcept {
+        // Called with this thread counted in poppers; first..last are linked
+        // through next_pending and have already been unlinked from the stack
+        if (poppers == 1) {
+            node* old_pending = pending.exchange(nullptr);
+            if (--poppers == 0)
+                delete_pending(old_pending);
+            else if (old_pending)
+                defer(old_pending, nullptr);
+            last->next_pending = nullptr;
+            delete_pending(first);
+        } else {
+            defer(first, last);
+            --poppers;
+        }
+    }
+
+    template <typename T>
+    void ConcurrentStack<T>::defer(node* first, node* last) noexcept {
+        if (! last)
+            for (last = first; last->next_pending; last = last->next_pending) {}
+        last->next_pending = pending.load();
+        while (! pending.compare_exchange_weak(last->next_pending, first)) {}
+    }
+
+    template <typename T>
+    void ConcurrentStack<T>::delete_pending(node* n) noexcept {
+        while (n) {
+            node* next = n->next_pending;
+            delete n;
+            n = next;
+        }
+    }
+
 }
@@ -1,6 +1,12 @@
 #include "rs-core/statistics.hpp"
 #include "rs-core/unit-test.hpp"
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
 #include <map>
+#include <random>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 using namespace RS;
@@ -92,10 +98,228 @@ namespace {
 
     }
 
+
+    void check_statistics_accuracy() {
+
+        // Large offset data: the sum of squares loses all precision here
+
+        Statistics<> stats;
+        const double offset = 1e9;
+
+        for (double x: {4.0, 7.0, 13.0, 16.0})
+            TRY(stats.add(offset + x, offset - 2 * x));
+
+        TEST_EQUAL(stats.num(), 4);
+        TEST_EQUAL(stats.mean_x(), offset + 10);
+        TEST_EQUAL(stats.mean_y(), offset - 20);
+        TEST_NEAR(stats.stdevp_x(), 4.743416);
+        TEST_NEAR(stats.stdevs_x(), 5.477226);
+        TEST_NEAR(stats.stdevp_y(), 9.486833);
+        TEST_NEAR(stats.correlation(), -1);
+        TEST_NEAR(stats.linear().first, -2);
+        TEST_NEAR_EPSILON(stats.linear().second, 3 * offset, 1e-3);
+
+    }
+
+    void check_statistics_merge() {
+
+        Statistics<> all, a, b, c;
+        std::vector<std::pair<double, double>> v;
+
+        for (int i = 1; i <= 1000; ++i)
+            v.push_back({i % 37 + 0.5 * i, i % 11 - 0.1 * i});
+        TRY(all.append(v));
+        for (size_t i = 0; i < 300; ++i)
+            TRY(a.add(v[i]));
+        for (size_t i = 300; i < v.size(); ++i)
+            TRY(b.add(v[i]));
+
+        TRY(c = a);
+        TRY(c.merge(b));
+        TEST_EQUAL(c.num(), 1000);
+        TEST_EQUAL(c.min_x(), all.min_x());
+        TEST_EQUAL(c.max_x(), all.max_x());
+        TEST_EQUAL(c.min_y(), all.min_y());
+        TEST_EQUAL(c.max_y(), all.max_y());
+        TEST_NEAR(c.mean_x(), all.mean_x());
+        TEST_NEAR(c.mean_y(), all.mean_y());
+        TEST_NEAR(c.stdevs_x(), all.stdevs_x());
+        TEST_NEAR(c.stdevs_y(), all.stdevs_y());
+        TEST_NEAR(c.correlation(), all.correlation());
+        TEST_NEAR(c.linear().first, all.linear().first);
+        TEST_NEAR(c.linear().second, all.linear().second);
+
+        TRY(c.clear());
+        TRY(c += Statistics<>());
+        TEST(c.empty());
+        TRY(c += b);
+        TRY(c += Statistics<>());
+        TRY(c += a);
+        TEST_EQUAL(c.num(), 1000);
+        TEST_NEAR(c.mean_x(), all.mean_x());
+        TEST_NEAR(c.stdevp_y(), all.stdevp_y());
+        TEST_NEAR(c.correlation(), all.correlation());
+
+        std::vector<double> w;
+        for (int i = 0; i < 100000; ++i)
+            w.push_back(1e6 + (i * 7919) % 1000);
+        TRY(a.clear());
+        TRY(a.append(w));
+        for (size_t threads: {0, 1, 2, 3, 8}) {
+            TRY(b.clear());
+            TRY(b.parallel_append(w, threads));
+            TEST_EQUAL(b.num(), a.num());
+            TEST_EQUAL(b.min(), a.min());
+            TEST_EQUAL(b.max(), a.max());
+            TEST_NEAR(b.mean(), a.mean());
+            TEST_NEAR(b.stdevs(), a.stdevs());
+        }
+        TRY(b.clear());
+        TRY(b.parallel_append(v, 4));
+        TEST_EQUAL(b.num(), 1000);
+        TEST_NEAR(b.correlation(), all.correlation());
+        TRY(b.clear());
+        TRY(b.parallel_append(std::vector<double>(), 4));
+        TEST(b.empty());
+
+    }
+
+    void check_quantile_sketch() {
+
+        QuantileSketch<> qs;
+        std::vector<double> v;
+
+        TEST(qs.empty());
+        TEST_EQUAL(qs.compression(), 300);
+        TEST_EQUAL(qs.quantile(0.5), 0);
+        TEST_THROW(QuantileSketch<>(1), std::invalid_argument);
+
+        TRY(qs.add(42));
+        TEST_EQUAL(qs.num(), 1);
+        TEST_EQUAL(qs.quantile(0), 42);
+        TEST_EQUAL(qs.quantile(0.5), 42);
+        TEST_EQUAL(qs.quantile(1), 42);
+
+        TRY(qs.clear());
+        for (int i = 1; i <= 100; ++i)
+            TRY(qs.add(i));
+        TEST_EQUAL(qs.num(), 100);
+        TEST_EQUAL(qs.min(), 1);
+        TEST_EQUAL(qs.max(), 100);
+        TEST_NEAR(qs.quantile(0.5), 50.5);
+        TEST_NEAR(qs.quantile(0.99), 99.5);
+
+        // Compare rank error against exact quantiles, for a single sketch
+        // and for sketches merged from separate parts of the data
+
+        std::mt19937 rng(42);
+        std::lognormal_distribution<double> dist(10, 1.5);
+        for (int i = 0; i < 200000; ++i)
+            v.push_back(dist(rng));
+        auto sorted = v;
+        std::sort(sorted.begin(), sorted.end());
+        auto rank = [&] (double x) { return double(std::lower_bound(sorted.begin(), sorted.end(), x) - sorted.begin()) / double(v.size()); };
+
+        QuantileSketch<> all, part[4];
+        TRY(all.append(v));
+        for (size_t i = 0; i < v.size(); ++i)
+            TRY(part[i % 4].add(v[i]));
+        QuantileSketch<> merged;
+        for (auto& p: part)
+            TRY(merged += p);
+        TEST_EQUAL(merged.num(), v.size());
+        TEST_EQUAL(merged.min(), sorted.front());
+        TEST_EQUAL(merged.max(), sorted.back());
+
+        for (auto* q: {&all, &merged}) {
+            TEST_NEAR_EPSILON(rank(q->quantile(0.5)), 0.5, 0.005);
+            TEST_NEAR_EPSILON(rank(q->quantile(0.9)), 0.9, 0.002);
+            TEST_NEAR_EPSILON(rank(q->quantile(0.99)), 0.99, 0.0005);
+            TEST_NEAR_EPSILON(rank(q->quantile(0.999)), 0.999, 0.0001);
+            TEST_NEAR_EPSILON(rank(q->quantile(0.001)), 0.001, 0.0001);
+        }
+
+        TRY(merged.merge(merged));
+        TEST_EQUAL(merged.num(), 2 * v.size());
+        TEST_NEAR_EPSILON(rank(merged.quantile(0.99)), 0.99, 0.0005);
+
+    }
+
+    void check_histogram() {
+
+        Histogram h;
+        std::vector<uint64_t> v;
+
+        TEST(h.empty());
+        TEST_EQUAL(h.precision(), 8);
+        TEST_EQUAL(h.quantile(0.5), 0);
+        TEST_THROW(Histogram(0), std::invalid_argument);
+        TEST_THROW(Histogram(17), std::invalid_argument);
+
+        for (uint64_t x = 1; x <= 100; ++x)
+            TRY(h.add(x));
+        TEST_EQUAL(h.num(), 100);
+        TEST_EQUAL(h.min(), 1);
+        TEST_EQUAL(h.max(), 100);
+        TEST_EQUAL(h.mean(), 50.5);
+        TEST_EQUAL(h.quantile(0.5), 50);
+        TEST_EQUAL(h.quantile(0.99), 99);
+        TEST_EQUAL(h.quantile(1), 100);
+
+        TRY(h.clear());
+        TRY(h.add(0, 3));
+        TRY(h.add(~ uint64_t(0)));
+        TEST_EQUAL(h.num(), 4);
+        TEST_EQUAL(h.quantile(0.5), 0);
+        TEST_EQUAL(h.quantile(0.9), ~ uint64_t(0));
+
+        // Reported quantiles are never below the exact value, and never
+        // above it by more than the bucket width
+
+        std::mt19937_64 rng(42);
+        std::lognormal_distribution<double> dist(12, 2);
+        for (int i = 0; i < 200000; ++i)
+            v.push_back(uint64_t(dist(rng)));
+        auto sorted = v;
+        std::sort(sorted.begin(), sorted.end());
+
+        Histogram all, part[3], merged;
+        TRY(all.append(v));
+        for (size_t i = 0; i < v.size(); ++i)
+            TRY(part[i % 3].add(v[i]));
+        for (auto& p: part)
+            TRY(merged += p);
+        TEST_EQUAL(merged.num(), v.size());
+        TEST_EQUAL(merged.min(), sorted.front());
+        TEST_EQUAL(merged.max(), sorted.back());
+
+        for (double p: {0.01, 0.5, 0.9, 0.99, 0.999, 0.9999}) {
+            uint64_t exact = sorted[size_t(std::ceil(p * double(v.size()))) - 1];
+            uint64_t x = all.quantile(p);
+            TEST_COMPARE(x, >=, exact);
+            TEST_COMPARE(double(x - exact), <=, double(exact) / 128);
+            TEST_EQUAL(merged.quantile(p), x);
+        }
+
+        Histogram coarse(4);
+        TEST_THROW(coarse.merge(all), std::invalid_argument);
+        TRY(coarse.append(v));
+        for (double p: {0.5, 0.99}) {
+            uint64_t exact = sorted[size_t(std::ceil(p * double(v.size()))) - 1];
+            uint64_t x = coarse.quantile(p);
+            TEST_COMPARE(x, >=, exact);
+            TEST_COMPARE(double(x - exact), <=, double(exact) / 8);
+        }
+
+    }
 }
 
 TEST_MODULE(core, statistics) {
 
     check_statistics();
+    check_statistics_accuracy();
+    check_statistics_merge();
+    check_quantile_sketch();
+    check_histogram();
 
 }
@@ -1,9 +1,16 @@
 #pragma once
 
 #include "rs-core/common.hpp"
+#include "rs-core/thread.hpp"
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <iterator>
+#include <stdexcept>
+#include <string>
 #include <type_traits>
 #include <utility>
+#include <vector>
 
 namespace RS {
 
@@ -14,8 +21,11 @@ namespace RS {
         Statistics() = default;
         void add(T x, T y = 0) noexcept;
         void add(const std::pair<T, T>& xy) noexcept { add(xy.first, xy.second); }
-        template <typename Range> void append(const Range& r) { for (auto& t: r) add(t); }
-        void clear() noexcept { xmin = ymin = xmax = ymax = xsum = x2sum = xysum = ysum = y2sum = 0; n = 0; }
+        template <typename Range> void append(const Range& r) { using std::begin; using std::end; append_range(begin(r), end(r)); }
+        template <typename Range> void parallel_append(const Range& r, size_t threads = 0);
+        void clear() noexcept { xmin = ymin = xmax = ymax = xmean = ymean = xdev2 = ydev2 = xydev = 0; n = 0; }
+        void merge(const Statistics& s) noexcept;
+        Statistics& operator+=(const Statistics& s) noexcept { merge(s); return *this; }
         bool empty() const noexcept { return n == 0; }
         size_t num() const noexcept { return n; }
         T min() const noexcept { return xmin; }
@@ -25,14 +35,14 @@ namespace RS {
         T max_x() const noexcept { return xmax; }
         T max_y() const noexcept { return ymax; }
         T mean() const noexcept { return mean_x(); }
-        T mean_x() const noexcept { return n ? xsum / T(n) : T(0); }
-        T mean_y() const noexcept { return n ? ysum / T(n) : T(0); }
+        T mean_x() const noexcept { return xmean; }
+        T mean_y() const noexcept { return ymean; }
         T stdevp() const noexcept { return stdevp_x(); }
-        T stdevp_x() const noexcept { return get_stdevp(n, xsum, x2sum); }
-        T stdevp_y() const noexcept { return get_stdevp(n, ysum, y2sum); }
+        T stdevp_x() const noexcept { return n ? std::sqrt(xdev2 / T(n)) : T(0); }
+        T stdevp_y() const noexcept { return n ? std::sqrt(ydev2 / T(n)) : T(0); }
         T stdevs() const noexcept { return stdevs_x(); }
-        T stdevs_x() const noexcept { return get_stdevs(n, xsum, x2sum); }
-        T stdevs_y() const noexcept { return get_stdevs(n, ysum, y2sum); }
+        T stdevs_x() const noexcept { return n >= 2 ? std::sqrt(xdev2 / (T(n) - T(1))) : T(0); }
+        T stdevs_y() const noexcept { return n >= 2 ? std::sqrt(ydev2 / (T(n) - T(1))) : T(0); }
         T correlation() const noexcept;
         std::pair<T, T> linear() const noexcept;
     private:
@@ -41,65 +51,431 @@ namespace RS {
         T ymin = 0;
         T xmax = 0;
         T ymax = 0;
-        T xsum = 0;
-        T x2sum = 0;
-        T xysum = 0;
-        T ysum = 0;
-        T y2sum = 0;
+        T xmean = 0;
+        T ymean = 0;
+        T xdev2 = 0; // Sum of squared deviations from the mean
+        T ydev2 = 0;
+        T xydev = 0; // Sum of products of deviations
         size_t n = 0;
-        static T get_stdevs(size_t n, T sum, T sum2) noexcept;
-        static T get_stdevp(size_t n, T sum, T sum2) noexcept;
+        template <typename Iterator> void append_range(Iterator i, Iterator j);
+        void add_block(const T* xs, const T* ys, size_t m) noexcept;
+        static void split(T t, T& x, T& y) noexcept { x = t; y = 0; }
+        static void split(const std::pair<T, T>& xy, T& x, T& y) noexcept { x = xy.first; y = xy.second; }
     };
 
     template <typename T>
     void Statistics<T>::add(T x, T y) noexcept {
+        // Welford's algorithm: update the means and the sums of deviations
+        // incrementally instead of keeping raw sums of powers, which lose
+        // precision when the mean is large compared to the spread
         xmin = n ? std::min(xmin, x) : x;
         ymin = n ? std::min(ymin, y) : y;
         xmax = n ? std::max(xmax, x) : x;
         ymax = n ? std::max(ymax, y) : y;
-        xsum += x;
-        x2sum += x * x;
-        xysum += x * y;
-        ysum += y;
-        y2sum += y * y;
         ++n;
+        T r = T(1) / T(n);
+        T dx = x - xmean;
+        T dy = y - ymean;
+        xmean += dx * r;
+        ymean += dy * r;
+        T ey = y - ymean;
+        xdev2 += dx * (x - xmean);
+        ydev2 += dy * ey;
+        xydev += dx * ey;
+    }
+
+    template <typename T>
+    void Statistics<T>::merge(const Statistics& s) noexcept {
+        // Chan et al's pairwise combination of Welford accumulators
+        if (s.n == 0)
+            return;
+        if (n == 0) {
+            *this = s;
+            return;
+        }
+        xmin = std::min(xmin, s.xmin);
+        ymin = std::min(ymin, s.ymin);
+        xmax = std::max(xmax, s.xmax);
+        ymax = std::max(ymax, s.ymax);
+        T na = T(n), nb = T(s.n), nab = na + nb;
+        T dx = s.xmean - xmean;
+        T dy = s.ymean - ymean;
+        T w = na * nb / nab;
+        xmean += dx * nb / nab;
+        ymean += dy * nb / nab;
+        xdev2 += s.xdev2 + dx * dx * w;
+        ydev2 += s.ydev2 + dy * dy * w;
+        xydev += s.xydev + dx * dy * w;
+        n += s.n;
+    }
+
+    template <typename T>
+    template <typename Range>
+    void Statistics<T>::parallel_append(const Range& r, size_t threads) {
+        // Split the range into one contiguous chunk per thread, and merge
+        // the partial results in order so the result is deterministic;
+        // the last chunk runs in the calling thread
+        static const size_t cpus = Thread::cpu_threads();
+        static constexpr size_t min_per_thread = 16384;
+        using std::begin;
+        using std::end;
+        auto first = begin(r);
+        auto last = end(r);
+        auto size = size_t(std::distance(first, last));
+        if (threads == 0)
+            threads = std::min(cpus, size / min_per_thread);
+        threads = std::min(std::max(threads, size_t(1)), std::max(size, size_t(1)));
+        if (threads == 1) {
+            append(r);
+            return;
+        }
+        std::vector<Statistics> part(threads);
+        std::vector<Thread> workers;
+        workers.reserve(threads - 1);
+        auto i = first;
+        for (size_t k = 0; k < threads; ++k) {
+            auto j = i;
+            std::advance(j, size * (k + 1) / threads - size * k / threads);
+            auto& stats = part[k];
+            if (k + 1 < threads)
+                workers.emplace_back([&stats, i, j] { stats.append_range(i, j); });
+            else
+                stats.append_range(i, j);
+            i = j;
+        }
+        for (auto& w: workers)
+            w.wait();
+        for (auto& s: part)
+            merge(s);
+    }
+
+    template <typename T>
+    template <typename Iterator>
+    void Statistics<T>::append_range(Iterator i, Iterator j) {
+        // Collect values in small blocks and merge each block's moments;
+        // this avoids a division per element and lets the compiler
+        // vectorize the inner loops
+        static constexpr size_t block_size = 64;
+        T xs[block_size], ys[block_size];
+        size_t m = 0;
+        for (; i != j; ++i) {
+            split(*i, xs[m], ys[m]);
+            if (++m == block_size) {
+                add_block(xs, ys, m);
+                m = 0;
+            }
+        }
+        add_block(xs, ys, m);
+    }
+
+    template <typename T>
+    void Statistics<T>::add_block(const T* xs, const T* ys, size_t m) noexcept {
+        // Two pass algorithm within the block, shifted by the first value
+        // to avoid cancellation when the mean is large
+        if (m == 0)
+            return;
+        Statistics b;
+        b.n = m;
+        b.xmin = b.xmax = xs[0];
+        b.ymin = b.ymax = ys[0];
+        T xsum = 0, ysum = 0;
+        for (size_t i = 0; i < m; ++i) {
+            b.xmin = std::min(b.xmin, xs[i]);
+            b.xmax = std::max(b.xmax, xs[i]);
+            b.ymin = std::min(b.ymin, ys[i]);
+            b.ymax = std::max(b.ymax, ys[i]);
+            xsum += xs[i] - xs[0];
+            ysum += ys[i] - ys[0];
+        }
+        T dxmean = xsum / T(m);
+        T dymean = ysum / T(m);
+        for (size_t i = 0; i < m; ++i) {
+            T dx = (xs[i] - xs[0]) - dxmean;
+            T dy = (ys[i] - ys[0]) - dymean;
+            b.xdev2 += dx * dx;
+            b.ydev2 += dy * dy;
+            b.xydev += dx * dy;
+        }
+        b.xmean = xs[0] + dxmean;
+        b.ymean = ys[0] + dymean;
+        merge(b);
     }
 
     template <typename T>
     T Statistics<T>::correlation() const noexcept {
-        if (n < 2)
-            return 0;
-        T a = T(n) * xysum - xsum * ysum;
-        T b = T(n) * x2sum - xsum * xsum;
-        T c = T(n) * y2sum - ysum * ysum;
-        if (b == 0 || c == 0)
+        if (n < 2 || xdev2 == 0 || ydev2 == 0)
             return 0;
         else
-            return a / std::sqrt(b * c);
+            return xydev / std::sqrt(xdev2 * ydev2);
     }
 
     template <typename T>
     std::pair<T, T> Statistics<T>::linear() const noexcept {
         if (n == 0)
             return {T(0), T(0)};
-        else if (n == 1)
-            return {T(0), ysum};
-        T d = T(n) * x2sum - xsum * xsum;
-        if (d == 0)
-            return {T(0), mean_y()};
-        T a = (T(n) * xysum - xsum * ysum) / d;
-        T b = (ysum - a * xsum) / T(n);
+        else if (n == 1 || xdev2 == 0)
+            return {T(0), ymean};
+        T a = xydev / xdev2;
+        T b = ymean - a * xmean;
         return {a, b};
     }
 
+    template <typename T = double>
+    class QuantileSketch {
+    public:
+        using scalar_type = T;
+        QuantileSketch(): QuantileSketch(T(300)) {}
+        explicit QuantileSketch(T compression);
+        void add(T x);
+        template <typename Range> void append(const Range& r) { for (auto& t: r) add(t); }
+        void clear() noexcept { centroids.clear(); buffer.clear(); xmin = xmax = 0; n = 0; }
+        T compression() const noexcept { return delta; }
+        bool empty() const noexcept { return n == 0; }
+        void merge(const QuantileSketch& s);
+        QuantileSketch& operator+=(const QuantileSketch& s) { merge(s); return *this; }
+        size_t num() const noexcept { return n; }
+        T min() const noexcept { return xmin; }
+        T max() const noexcept { return xmax; }
+        T quantile(T p) const;
+    private:
+        static_assert(std::is_floating_point<T>::value);
+        struct centroid { T mean; T weight; };
+        T delta;
+        size_t buffer_limit;
+        // Incoming values are buffered and merged into the centroids in
+        // batches; queries flush the buffer, so these are mutable
+        mutable std::vector<centroid> centroids;
+        mutable std::vector<T> buffer;
+        T xmin = 0;
+        T xmax = 0;
+        size_t n = 0;
+        void compress() const;
+        void combine(const centroid* in, size_t m) const;
+        T next_limit(T q, T total) const noexcept;
+    };
+
+    template <typename T>
+    QuantileSketch<T>::QuantileSketch(T compression):
+    delta(compression), buffer_limit(size_t(5 * compression)) {
+        if (! (compression >= 10))
+            throw std::invalid_argument("Invalid quantile sketch compression");
+    }
+
+    template <typename T>
+    void QuantileSketch<T>::add(T x) {
+        xmin = n ? std::min(xmin, x) : x;
+        xmax = n ? std::max(xmax, x) : x;
+        ++n;
+        buffer.push_back(x);
+        if (buffer.size() >= buffer_limit)
+            compress();
+    }
+
     template <typename T>
-    T Statistics<T>::get_stdevs(size_t n, T sum, T sum2) noexcept {
-        return n >= 2 ? std::sqrt((sum2 - sum * sum / T(n)) / (T(n) - T(1))) : T(0);
+    void QuantileSketch<T>::merge(const QuantileSketch& s) {
+        if (s.n == 0)
+            return;
+        if (&s == this) {
+            QuantileSketch t(s);
+            merge(t);
+            return;
+        }
+        compress();
+        s.compress();
+        xmin = n ? std::min(xmin, s.xmin) : s.xmin;
+        xmax = n ? std::max(xmax, s.xmax) : s.xmax;
+        n += s.n;
+        combine(s.centroids.data(), s.centroids.size());
     }
 
     template <typename T>
-    T Statistics<T>::get_stdevp(size_t n, T sum, T sum2) noexcept {
-        return n ? std::sqrt((sum2 - sum * sum / T(n)) / T(n)) : T(0);
+    T QuantileSketch<T>::quantile(T p) const {
+        // Interpolate between centroid centres, treating the minimum and
+        // maximum as the outer boundaries
+        if (n == 0)
+            return 0;
+        if (p <= 0)
+            return xmin;
+        if (p >= 1)
+            return xmax;
+        compress();
+        auto& c = centroids;
+        T index = p * T(n);
+        T half = c[0].weight / 2;
+        if (index < half)
+            return xmin + (c[0].mean - xmin) * (index / half);
+        T so_far = half;
+        for (size_t i = 0; i + 1 < c.size(); ++i) {
+            T dw = (c[i].weight + c[i + 1].weight) / 2;
+            if (so_far + dw > index)
+                return c[i].mean + (c[i + 1].mean - c[i].mean) * ((index - so_far) / dw);
+            so_far += dw;
+        }
+        half = c.back().weight / 2;
+        return c.back().mean + (xmax - c.back().mean) * std::min((index - so_far) / half, T(1));
+    }
+
+    template <typename T>
+    void QuantileSketch<T>::compress() const {
+        if (buffer.empty())
+            return;
+        std::sort(buffer.begin(), buffer.end());
+        std::vector<centroid> in(buffer.size());
+        for (size_t i = 0; i < buffer.size(); ++i)
+            in[i] = {buffer[i], T(1)};
+        buffer.clear();
+        combine(in.data(), in.size());
+    }
+
+    template <typename T>
+    void QuantileSketch<T>::combine(const centroid* in, size_t m) const {
+        // Merging t-digest: walk the new centroids and the existing ones
+        // together in order of their means, merging neighbours greedily as
+        // long as the result stays within the size limit for its quantile
+        if (m == 0)
+            return;
+        std::vector<centroid> out;
+        out.reserve(centroids.size() + 16);
+        T total = T(n);
+        T so_far = 0;
+        T limit = 0;
+        const centroid* p = centroids.data();
+        const centroid* p_end = p + centroids.size();
+        const centroid* q = in;
+        const centroid* q_end = in + m;
+        centroid current = {0, 0};
+        while (p != p_end || q != q_end) {
+            auto& b = q == q_end || (p != p_end && p->mean < q->mean) ? *p++ : *q++;
+            if (current.weight == 0) {
+                current = b;
+            } else if (so_far + current.weight + b.weight <= limit) {
+                current.weight += b.weight;
+                current.mean += (b.mean - current.mean) * b.weight / current.weight;
+            } else {
+                so_far += current.weight;
+                out.push_back(current);
+                limit = total * next_limit(so_far / total, total);
+                current = b;
+            }
+        }
+        out.push_back(current);
+        centroids.swap(out);
+    }
+
+    template <typename T>
+    T QuantileSketch<T>::next_limit(T q, T total) const noexcept {
+        // Scale function k(q) = delta/z*log(q/(1-q)), z = 4log(n/delta)+24;
+        // a centroid starting at q can extend to the quantile where k has
+        // increased by 1. Centroid size is proportional to q(1-q), so the
+        // tails are kept at high resolution.
+        if (q <= 0)
+            return 0;
+        T z = 4 * std::log(std::max(total / delta, T(1))) + 24;
+        T k = delta / z * std::log(q / (1 - q)) + 1;
+        return 1 / (1 + std::exp(- k * z / delta));
+    }
+
+    class Histogram {
+    public:
+        Histogram(): Histogram(8) {}
+        explicit Histogram(int precision);
+        void add(uint64_t x) noexcept { add(x, 1); }
+        void add(uint64_t x, size_t count) noexcept;
+        template <typename Range> void append(const Range& r) { for (auto& t: r) add(t); }
+        void clear() noexcept;
+        bool empty() const noexcept { return n == 0; }
+        void merge(const Histogram& h);
+        Histogram& operator+=(const Histogram& h) { merge(h); return *this; }
+        size_t num() const noexcept { return n; }
+        uint64_t min() const noexcept { return xmin; }
+        uint64_t max() const noexcept { return xmax; }
+        double mean() const noexcept { return n ? sum / double(n) : 0; }
+        int precision() const noexcept { return bits; }
+        uint64_t quantile(double p) const noexcept;
+    private:
+        // Values below 2^bits have their own bucket; above that, each power
+        // of 2 is divided into 2^(bits-1) equal sub-buckets
+        int bits;
+        size_t half;
+        std::vector<uint64_t> counts;
+        uint64_t xmin = 0;
+        uint64_t xmax = 0;
+        double sum = 0;
+        size_t n = 0;
+        size_t bucket(uint64_t x) const noexcept;
+        uint64_t bucket_max(size_t i) const noexcept;
+    };
+
+    inline Histogram::Histogram(int precision):
+    bits(precision) {
+        if (precision < 1 || precision > 16)
+            throw std::invalid_argument("Invalid histogram precision: " + std::to_string(precision));
+        half = size_t(1) << (bits - 1);
+        counts.resize((66 - bits) * half, 0);
+    }
+
+    inline void Histogram::add(uint64_t x, size_t count) noexcept {
+        if (count == 0)
+            return;
+        counts[bucket(x)] += count;
+        xmin = n ? std::min(xmin, x) : x;
+        xmax = n ? std::max(xmax, x) : x;
+        sum += double(x) * double(count);
+        n += count;
+    }
+
+    inline void Histogram::clear() noexcept {
+        std::fill(counts.begin(), counts.end(), 0);
+        xmin = xmax = 0;
+        sum = 0;
+        n = 0;
+    }
+
+    inline void Histogram::merge(const Histogram& h) {
+        if (h.bits != bits)
+            throw std::invalid_argument("Histogram precision does not match");
+        if (h.n == 0)
+            return;
+        for (size_t i = 0; i < counts.size(); ++i)
+            counts[i] += h.counts[i];
+        xmin = n ? std::min(xmin, h.xmin) : h.xmin;
+        xmax = n ? std::max(xmax, h.xmax) : h.xmax;
+        sum += h.sum;
+        n += h.n;
+    }
+
+    inline uint64_t Histogram::quantile(double p) const noexcept {
+        // Returns the highest value in the bucket containing the requested
+        // rank, clamped to the observed range
+        if (n == 0)
+            return 0;
+        if (p <= 0)
+            return xmin;
+        if (p >= 1)
+            return xmax;
+        auto rank = std::max(uint64_t(std::ceil(p * double(n))), uint64_t(1));
+        uint64_t so_far = 0;
+        for (size_t i = 0; i < counts.size(); ++i) {
+            so_far += counts[i];
+            if (so_far >= rank)
+                return std::min(std::max(bucket_max(i), xmin), xmax);
+        }
+        return xmax;
+    }
+
+    inline size_t Histogram::bucket(uint64_t x) const noexcept {
+        if (x < 2 * half)
+            return size_t(x);
+        int shift = int(ilog2p1(x)) - bits;
+        return size_t(shift) * half + size_t(x >> shift);
+    }
+
+    inline uint64_t Histogram::bucket_max(size_t i) const noexcept {
+        if (i < 2 * half)
+            return i;
+        int shift = int(i / half) - 1;
+        uint64_t m = i - size_t(shift) * half;
+        return ((m + 1) << shift) - 1;
     }
 
 }
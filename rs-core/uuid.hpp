@@ -54,7 +54,7 @@ namespace RS {
         const uint8_t* begin() const noexcept { return bytes; }
         uint8_t* end() noexcept { return bytes + 16; }
         const uint8_t* end() const noexcept { return bytes + 16; }
-        size_t hash() const noexcept { return djb2a(bytes, 16); }
+        size_t hash() const noexcept { return wyhash(bytes, 16); }
         U8string str() const;
         friend bool operator==(const Uuid& lhs, const Uuid& rhs) noexcept { return memcmp(lhs.bytes, rhs.bytes, 16) == 0; }
         friend bool operator<(const Uuid& lhs, const Uuid& rhs) noexcept { return memcmp(lhs.bytes, rhs.bytes, 16) == -1; }